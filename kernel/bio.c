@@ -1,10 +1,23 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Each hash bucket has its own lock, so lookups of different
+// blocks on different harts don't contend.
+//
+// The cache starts with NBUF buffers and grows with buffers from
+// a slab cache, up to 1/BCACHEFRAC of RAM; kalloc() takes the
+// unused ones back when memory runs out. Once full, it recycles
+// buffers by 2Q, so one pass over a big file can't flush out
+// the blocks that are used over and over: a block enters the
+// "in" FIFO, and only if it is read again soon after being
+// pushed out of there (while it is still remembered in the
+// ghost table) does it join the "am" queue, which is run as
+// a CLOCK.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
@@ -22,70 +35,294 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "memlayout.h"
+#include "slab.h"
+
+#define NBUCKET 251
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+#define NGHOST  1024
+#define GHASH(dev, blockno) (((dev) * 31 + (blockno)) % NGHOST)
+#define GKEY(dev, blockno) (((uint64)(dev) << 32) | (blockno))
 
 struct {
-  struct spinlock lock;
-  struct buf buf[NBUF];
+  struct spinlock lock;   // guards misses, the queues and the ghosts
+  struct buf buf[NBUF];   // never given back
+  struct kmem_cache cache; // the rest
+  int nbuf;
+  int minbuf;             // never shrink below
+  int maxbuf;
+
+  struct bqueue in;       // blocks read once, oldest first
+  struct bqueue am;       // blocks read again; head is the clock hand
+
+  // Blocks recently pushed out of in, direct-mapped.
+  uint64 ghost[NGHOST];
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // Buffers holding each hash bucket's blocks,
+  // in a list through prev/next.
+  struct {
+    struct spinlock lock;
+    struct buf *head;
+  } bucket[NBUCKET];
+
+  uint nhit;
+  uint nmiss;
+  uint nevict;
+  uint nghost;
 } bcache;
 
+static void
+qpush(struct bqueue *q, struct buf *b)
+{
+  b->q = q;
+  b->qnext = 0;
+  b->qprev = q->tail;
+  if(q->tail)
+    q->tail->qnext = b;
+  else
+    q->head = b;
+  q->tail = b;
+  q->n++;
+}
+
+static void
+qremove(struct buf *b)
+{
+  struct bqueue *q = b->q;
+
+  if(b->qprev)
+    b->qprev->qnext = b->qnext;
+  else
+    q->head = b->qnext;
+  if(b->qnext)
+    b->qnext->qprev = b->qprev;
+  else
+    q->tail = b->qprev;
+  q->n--;
+  b->q = 0;
+}
+
+// Add b to bucket h, whose lock the caller holds.
+static void
+bucket_insert(int h, struct buf *b)
+{
+  b->prev = 0;
+  b->next = bcache.bucket[h].head;
+  if(b->next)
+    b->next->prev = b;
+  bcache.bucket[h].head = b;
+}
+
+// Remove b from bucket h, whose lock the caller holds.
+static void
+bucket_remove(int h, struct buf *b)
+{
+  if(b->prev)
+    b->prev->next = b->next;
+  else
+    bcache.bucket[h].head = b->next;
+  if(b->next)
+    b->next->prev = b->prev;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  int i;
 
   initlock(&bcache.lock, "bcache");
+  kmem_cache_init(&bcache.cache, "buf", sizeof(struct buf));
+  for(i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  bcache.maxbuf = (PHYSTOP - KERNBASE) / BCACHEFRAC / sizeof(struct buf);
+  bcache.minbuf = NBUF;
+  if(bcache.maxbuf < NBUF)
+    bcache.maxbuf = NBUF;
+
+  // Spread the buffers over the buckets by giving them
+  // made-up block numbers on device 0, which is never read.
+  for(b = bcache.buf, i = 0; b < bcache.buf+NBUF; b++, i++){
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->blockno = i;
+    bucket_insert(BHASH(b->dev, b->blockno), b);
+    qpush(&bcache.in, b);
+    bcache.nbuf++;
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Look for block blockno on device dev in bucket h,
+// whose lock the caller holds. Takes a reference.
 static struct buf*
-bget(uint dev, uint blockno)
+blookup(int h, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bcache.bucket[h].head; b; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+      b->ref = 1;
       return b;
     }
   }
+  return 0;
+}
+
+// If no one is using b, take it out of its hash bucket
+// and queue and return 1. Caller holds bcache.lock.
+static int
+btake(struct buf *b)
+{
+  int h = BHASH(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
+  if(b->refcnt != 0 || b->disk){
+    release(&bcache.bucket[h].lock);
+    return 0;
+  }
+  bucket_remove(h, b);
+  release(&bcache.bucket[h].lock);
+  qremove(b);
+  return 1;
+}
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+// Take the oldest unused buffer from in, and
+// remember its block in the ghost table.
+static struct buf*
+bevict_in(void)
+{
+  struct buf *b;
+
+  for(b = bcache.in.head; b; b = b->qnext){
+    if(btake(b)){
+      if(b->valid)
+        bcache.ghost[GHASH(b->dev, b->blockno)] = GKEY(b->dev, b->blockno);
       return b;
     }
   }
-  panic("bget: no buffers");
+  return 0;
+}
+
+// Run the clock hand over am until it finds an unused
+// buffer that hasn't been read since it last passed.
+static struct buf*
+bevict_am(void)
+{
+  struct buf *b;
+  int h, i;
+
+  for(i = 0; i < 2*bcache.am.n; i++){
+    b = bcache.am.head;
+    h = BHASH(b->dev, b->blockno);
+    acquire(&bcache.bucket[h].lock);
+    if(b->refcnt == 0 && !b->ref && !b->disk){
+      bucket_remove(h, b);
+      release(&bcache.bucket[h].lock);
+      qremove(b);
+      return b;
+    }
+    b->ref = 0;
+    release(&bcache.bucket[h].lock);
+    qremove(b);
+    qpush(&bcache.am, b);
+  }
+  return 0;
+}
+
+// Find a buffer for a block that isn't cached:
+// a new one while the cache may grow, otherwise
+// one recycled by 2Q. Caller holds bcache.lock.
+static struct buf*
+balloc_buf(void)
+{
+  struct buf *b;
+
+  if(bcache.nbuf < bcache.maxbuf && (b = kmem_cache_alloc(&bcache.cache)) != 0){
+    memset(b, 0, sizeof(*b));
+    initsleeplock(&b->lock, "buffer");
+    bcache.nbuf++;
+    return b;
+  }
+
+  // keep in at about a quarter of the cache.
+  b = 0;
+  if(bcache.in.n > bcache.nbuf/4)
+    b = bevict_in();
+  if(b == 0)
+    b = bevict_am();
+  if(b == 0)
+    b = bevict_in();
+  if(b == 0)
+    panic("bget: no buffers");
+  bcache.nevict++;
+  return b;
+}
+
+// Lock b, which the caller holds a reference to,
+// and wait for any read-ahead into it to finish.
+static struct buf*
+bhold(struct buf *b)
+{
+  acquiresleep(&b->lock);
+  if(b->disk)
+    blkq_wait(b);
+  return b;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  struct buf *b;
+  int h, g;
+
+  h = BHASH(dev, blockno);
+  acquire(&bcache.bucket[h].lock);
+  b = blookup(h, dev, blockno);
+  release(&bcache.bucket[h].lock);
+  if(b){
+    __sync_fetch_and_add(&bcache.nhit, 1);
+    return bhold(b);
+  }
+
+  // Not cached. Only one hart at a time may bring in a
+  // block, and it must check again, so that a block
+  // can't end up cached twice.
+  acquire(&bcache.lock);
+  acquire(&bcache.bucket[h].lock);
+  b = blookup(h, dev, blockno);
+  release(&bcache.bucket[h].lock);
+  if(b){
+    release(&bcache.lock);
+    __sync_fetch_and_add(&bcache.nhit, 1);
+    return bhold(b);
+  }
+
+  b = balloc_buf();
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->ref = 0;
+  g = GHASH(dev, blockno);
+  if(bcache.ghost[g] == GKEY(dev, blockno)){
+    bcache.ghost[g] = 0;
+    bcache.nghost++;
+    qpush(&bcache.am, b);
+  } else {
+    qpush(&bcache.in, b);
+  }
+  acquire(&bcache.bucket[h].lock);
+  bucket_insert(h, b);
+  release(&bcache.bucket[h].lock);
+  bcache.nmiss++;
+  release(&bcache.lock);
+
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -96,58 +333,208 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    blkq_rw(b, 0);
     b->valid = 1;
   }
   return b;
 }
 
+// Start reading blocks blocknos[0..n-1] into the cache,
+// without waiting for the disk. A later bread() of one
+// of them waits for it, if it hasn't arrived yet.
+void
+breadahead(uint dev, uint *blocknos, int n)
+{
+  struct buf *b;
+  int h;
+
+  for(int i = 0; i < n; i++){
+    // cached already?
+    h = BHASH(dev, blocknos[i]);
+    acquire(&bcache.bucket[h].lock);
+    for(b = bcache.bucket[h].head; b; b = b->next)
+      if(b->dev == dev && b->blockno == blocknos[i])
+        break;
+    release(&bcache.bucket[h].lock);
+    if(b)
+      continue;
+
+    b = bget(dev, blocknos[i]);
+    if(!b->valid){
+      // bget() and the eviction code leave b alone
+      // until the disk is done with it.
+      blkq_submit(&b, 1, 0);
+      b->valid = 1;
+    }
+    brelse(b);
+  }
+  blkq_dispatch();
+}
+
+// Start reading into bufs[0..n-1], which are locked and
+// not in the cache, the blocks their dev and blockno say.
+// Wait for each with bwait().
+void
+bread_start(struct buf **bufs, int n)
+{
+  for(int i = 0; i < n; i++)
+    if(!holdingsleep(&bufs[i]->lock))
+      panic("bread_start");
+  blkq_submit(bufs, n, 0);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  blkq_rw(b, 1);
+}
+
+// Start writing the contents of bufs[0..n-1] to disk, along
+// with any other writes started before the next bwait(), so
+// that the I/O scheduler can sort and merge them. The bufs
+// must be locked, and stay locked until bwait() returns for
+// each.
+void
+bwrite_start(struct buf **bufs, int n)
+{
+  for(int i = 0; i < n; i++)
+    if(!holdingsleep(&bufs[i]->lock))
+      panic("bwrite_start");
+  blkq_submit(bufs, n, 1);
+}
+
+// Start writing bufs[0..n-1] as bwrite_start() does, but
+// without their locks, which the checkpoint would otherwise
+// hold for a whole burst, making a reader of any of them
+// wait for all of them. The bufs must be pinned, and the
+// caller must see to it that no one modifies them until
+// bwait() returns for each. Meanwhile a reader that locks
+// one waits just for its write (see bhold()).
+void
+bwrite_pinned(struct buf **bufs, int n)
+{
+  for(int i = 0; i < n; i++)
+    if(bufs[i]->refcnt < 1)
+      panic("bwrite_pinned");
+  blkq_submit(bufs, n, 1);
+}
+
+// Wait for a write started by bwrite_start(b).
+void
+bwait(struct buf *b)
+{
+  blkq_wait(b);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
+  int h;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  h = BHASH(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int h = BHASH(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int h = BHASH(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
+  release(&bcache.bucket[h].lock);
+}
+
+// Make sure the cache always has n more buffers than
+// it used to, for a caller that may pin that many.
+void
+breserve(int n)
+{
+  struct buf *b;
+  int h;
+
+  acquire(&bcache.lock);
+  bcache.minbuf += n;
+  if(bcache.maxbuf < bcache.minbuf)
+    bcache.maxbuf = bcache.minbuf;
+  for(; n > 0; n--){
+    if((b = kmem_cache_alloc(&bcache.cache)) == 0)
+      panic("breserve");
+    memset(b, 0, sizeof(*b));
+    initsleeplock(&b->lock, "buffer");
+    b->blockno = bcache.nbuf;  // as in binit()
+    h = BHASH(b->dev, b->blockno);
+    acquire(&bcache.bucket[h].lock);
+    bucket_insert(h, b);
+    release(&bcache.bucket[h].lock);
+    qpush(&bcache.in, b);
+    bcache.nbuf++;
+  }
   release(&bcache.lock);
 }
 
+// Give unused buffers back to the slab cache, for
+// kalloc() when memory runs out, down to bcache.minbuf.
+// The caller must hold no spinlocks.
+void
+bcachereclaim(void)
+{
+  struct bqueue *q;
+  struct buf *b, *next;
 
+  acquire(&bcache.lock);
+  for(q = &bcache.in; q; q = (q == &bcache.in ? &bcache.am : 0)){
+    for(b = q->head; b; b = next){
+      next = b->qnext;
+      if(bcache.nbuf <= bcache.minbuf)
+        break;
+      if(b >= bcache.buf && b < bcache.buf+NBUF)
+        continue;
+      if(btake(b)){
+        kmem_cache_free(&bcache.cache, b);
+        bcache.nbuf--;
+      }
+    }
+  }
+  release(&bcache.lock);
+}
+
+// Report the cache's size, hits, misses, evictions and
+// lock contention, for the statistics device.
+int
+bcachestats(char *buf, int sz)
+{
+  int n = 0, nts = 0, nacq = 0;
+
+  n += snprintf(buf+n, sz-n, "--- bcache: bufs %d max %d in %d am %d\n",
+                bcache.nbuf, bcache.maxbuf, bcache.in.n, bcache.am.n);
+  n += snprintf(buf+n, sz-n, "hit %d miss %d evict %d ghost hit %d\n",
+                bcache.nhit, bcache.nmiss, bcache.nevict, bcache.nghost);
+  n += snprint_lock(buf+n, sz-n, &bcache.lock);
+  for(int i = 0; i < NBUCKET; i++){
+    nts += bcache.bucket[i].lock.nts;
+    nacq += bcache.bucket[i].lock.n;
+  }
+  n += snprintf(buf+n, sz-n, "lock: bcache.bucket x%d: #test-and-set %d #acquire() %d\n",
+                NBUCKET, nts, nacq);
+  return n;
+}
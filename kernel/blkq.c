@@ -0,0 +1,211 @@
+//
+// Block I/O scheduler, between the buffer cache and
+// the virtio disk driver.
+//
+// blkq_submit() doesn't hand requests to the disk right
+// away; it keeps them in a queue sorted by block number.
+// blkq_dispatch() then feeds them to the driver as long as
+// the driver has room, in elevator (C-SCAN) order, with
+// each run of adjacent blocks in the same direction merged
+// into one request. A request that has waited past its
+// deadline goes first, reads before writes, so that a
+// stream of log or writeback traffic can't starve a
+// process waiting on a read.
+//
+// Requests are dispatched when a caller waits for one
+// (so that callers can submit several first) or starts
+// read-ahead, and when the disk finishes one and has
+// room for more.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+#include "virtio.h"
+
+#define READ_EXPIRE  1    // ticks a read may wait in the queue
+#define WRITE_EXPIRE 5    // ticks a write may wait in the queue
+#define NHIST        8    // histogram buckets: 0, 1, 2-3, 4-7, ...
+
+static struct {
+  struct spinlock lock;
+  struct buf *pending;   // sorted by (dev, blockno), through ionext
+  int npending;
+  int ninflight;         // dispatched, not yet finished
+  uint next;             // the elevator's position
+
+  uint nsubmit;          // blocks submitted
+  uint nrequest;         // requests sent to the disk
+  uint nexpired;         // ... of which because of a deadline
+  uint depth[NHIST];     // queue depth each block found
+  uint latency[NHIST];   // ticks from submit to wakeup
+} blkq;
+
+void
+blkq_init(void)
+{
+  initlock(&blkq.lock, "blkq");
+}
+
+// Which histogram bucket does n fall in?
+static int
+hist(uint n)
+{
+  int i;
+
+  for(i = 0; n > 0 && i < NHIST-1; i++)
+    n >>= 1;
+  return i;
+}
+
+// Queue requests to read or write bufs[0..n-1], which the
+// caller has locked, or pinned (see bwrite_pinned()), and
+// must blkq_wait() for before releasing.
+void
+blkq_submit(struct buf **bufs, int n, int write)
+{
+  struct buf *b, **pp;
+  int i;
+
+  acquire(&blkq.lock);
+  for(i = 0; i < n; i++){
+    b = bufs[i];
+    b->disk = 1;
+    b->iowrite = write;
+    b->iostart = ticks;
+    b->iodeadline = ticks + (write ? WRITE_EXPIRE : READ_EXPIRE);
+    for(pp = &blkq.pending; *pp; pp = &(*pp)->ionext)
+      if((*pp)->dev > b->dev || ((*pp)->dev == b->dev && (*pp)->blockno > b->blockno))
+        break;
+    b->ionext = *pp;
+    *pp = b;
+    blkq.depth[hist(blkq.npending + blkq.ninflight)]++;
+    blkq.npending++;
+    blkq.nsubmit++;
+  }
+  release(&blkq.lock);
+}
+
+// Choose the pending request to dispatch next: an expired
+// read, else an expired write, else the first at or after
+// the elevator's position, wrapping around.
+// Returns the link that points to it.
+static struct buf**
+pick(int *expired)
+{
+  struct buf **pp;
+
+  *expired = 1;
+  for(int write = 0; write <= 1; write++){
+    for(pp = &blkq.pending; *pp; pp = &(*pp)->ionext){
+      if((*pp)->iowrite == write && (int)(ticks - (*pp)->iodeadline) >= 0)
+        return pp;
+    }
+  }
+  *expired = 0;
+  for(pp = &blkq.pending; *pp; pp = &(*pp)->ionext)
+    if((*pp)->blockno >= blkq.next)
+      return pp;
+  return &blkq.pending;
+}
+
+// Hand pending requests to the disk while it has room.
+void
+blkq_dispatch(void)
+{
+  struct buf *run[MAXSEG], **pp, *b;
+  int n, expired;
+
+  acquire(&blkq.lock);
+  while(blkq.pending){
+    pp = pick(&expired);
+
+    // merge the blocks that follow it on the disk.
+    b = *pp;
+    n = 0;
+    run[n++] = b;
+    for(b = b->ionext; b && n < MAXSEG; b = b->ionext){
+      if(b->dev != run[0]->dev || b->blockno != run[n-1]->blockno+1 ||
+         b->iowrite != run[0]->iowrite)
+        break;
+      run[n++] = b;
+    }
+
+    if(virtio_disk_submit(run, n, run[0]->iowrite) < 0)
+      break;   // the disk is full; virtio_disk_intr() will call again.
+    *pp = b;
+    blkq.npending -= n;
+    blkq.ninflight += n;
+    blkq.nrequest++;
+    blkq.nexpired += expired;
+    blkq.next = run[n-1]->blockno + 1;
+  }
+  release(&blkq.lock);
+
+  virtio_disk_kick();
+}
+
+// The disk has finished n blocks' requests, and
+// may have room for more.
+void
+blkq_done(int n)
+{
+  acquire(&blkq.lock);
+  blkq.ninflight -= n;
+  release(&blkq.lock);
+  blkq_dispatch();
+}
+
+// Wait for the disk to finish with b, which was
+// queued by blkq_submit().
+void
+blkq_wait(struct buf *b)
+{
+  blkq_dispatch();
+  virtio_disk_wait(b);
+
+  acquire(&blkq.lock);
+  blkq.latency[hist(ticks - b->iostart)]++;
+  release(&blkq.lock);
+}
+
+// Read or write b, and wait for it.
+void
+blkq_rw(struct buf *b, int write)
+{
+  blkq_submit(&b, 1, write);
+  blkq_wait(b);
+}
+
+static int
+snprint_hist(char *buf, int sz, char *name, uint *h)
+{
+  int n = 0;
+
+  n += snprintf(buf+n, sz-n, "%s:", name);
+  for(int i = 0; i < NHIST; i++)
+    n += snprintf(buf+n, sz-n, " %d", h[i]);
+  n += snprintf(buf+n, sz-n, "\n");
+  return n;
+}
+
+// Report request counts and the queue depth and latency
+// histograms, for the statistics device.
+int
+blkqstats(char *buf, int sz)
+{
+  int n = 0;
+
+  acquire(&blkq.lock);
+  n += snprintf(buf+n, sz-n, "--- blkq: blocks %d requests %d expired %d pending %d\n",
+                blkq.nsubmit, blkq.nrequest, blkq.nexpired, blkq.npending);
+  n += snprint_hist(buf+n, sz-n, "depth 0,1,2-3,4-7..", blkq.depth);
+  n += snprint_hist(buf+n, sz-n, "latency (ticks) 0,1,2-3,4-7..", blkq.latency);
+  release(&blkq.lock);
+  return n;
+}
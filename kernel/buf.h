@@ -1,12 +1,28 @@
 struct buf {
-  int valid;   // has data been read from disk?
+  int valid;   // has data been read from disk (or started to be)?
   int disk;    // does disk "own" buf?
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  struct buf *prev; // hash bucket list
   struct buf *next;
+  struct buf *qprev; // replacement queue
+  struct buf *qnext;
+  struct bqueue *q; // which queue
+  int ref;     // referenced since the clock hand last passed?
+  struct buf *ionext; // blkq's pending list
+  int iowrite;
+  uint iostart;    // ticks when submitted
+  uint iodeadline; // dispatch by this tick
+  uint logseq; // log transaction that last logged b
+  int inlog;   // in the on-disk log, pinned until checkpointed
   uchar data[BSIZE];
 };
 
+// FIFO list of buffers, through qprev/qnext.
+struct bqueue {
+  struct buf *head;
+  struct buf *tail;
+  int n;
+};
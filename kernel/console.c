@@ -84,6 +84,10 @@ consoleread(int user_dst, uint64 dst, int n)
   char cbuf;
 
   target = n;
+  // copyout() can't fill a page of a mapped file
+  // while we hold cons.lock.
+  if(user_dst)
+    vmaprefault(dst, n);
   acquire(&cons.lock);
   while(n > 0){
     // wait until interrupt handler has put some
@@ -8,14 +8,32 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+void            bread_start(struct buf**, int);
+void            breadahead(uint, uint*, int);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwrite_start(struct buf**, int);
+void            bwrite_pinned(struct buf**, int);
+void            bwait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            bcachereclaim(void);
+void            breserve(int);
+int             bcachestats(char*, int);
+
+// blkq.c
+void            blkq_init(void);
+void            blkq_submit(struct buf**, int, int);
+void            blkq_dispatch(void);
+void            blkq_done(int);
+void            blkq_wait(struct buf*);
+void            blkq_rw(struct buf*, int);
+int             blkqstats(char*, int);
 
 // console.c
 void            consoleinit(void);
@@ -38,7 +56,7 @@ int             filewrite(struct file*, uint64, int n);
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
-struct inode*   ialloc(uint, short);
+struct inode*   ialloc(uint, short, uint);
 struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
@@ -49,10 +67,14 @@ void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
-int             readi(struct inode*, int, uint64, uint, uint);
+int             readi(struct inode*, int, uint64, uint64, uint);
+void            ireadahead(struct inode*, uint64, uint);
 void            stati(struct inode*, struct stat*);
-int             writei(struct inode*, int, uint64, uint, uint);
+int             writei(struct inode*, int, uint64, uint64, uint);
+int             writeiblocks(uint);
+uint            writeimax(int);
 void            itrunc(struct inode*);
+int             fsstats(char*, int);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -63,18 +85,36 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void*           kalloc_zeroed(void);
+void            kzero_refill(void);
+void            kpage_ref(void*);
+int             kpage_refcnt(void*);
+void*           kalloc_order(int);
+void            kfree_order(void*, int);
+void*           kalloc_contig(int);
+int             kallocstats(char*, int);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+void            log_sync(void);
+void            logtick(void);
 void            begin_op(void);
+void            begin_opn(int);
 void            end_op(void);
+void            end_opn(int);
+int             log_maxop(void);
+int             log_crash(int);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
+void            pipeinit(void);
+
+// sprintf.c
+int             snprintf(char*, int, char*, ...);
 
 // printf.c
 void            printf(char*, ...);
@@ -99,6 +139,7 @@ void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
+void            kthread(void (*)(void), char*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
@@ -117,6 +158,18 @@ void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+int             snprint_lock(char*, int, struct spinlock*);
+
+// slab.c
+struct kmem_cache;
+void            slabinit(void);
+void            kmem_cache_init(struct kmem_cache*, char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void*           kmalloc(uint);
+void            kmfree(void*);
+int             slabstats(char*, int);
+int             slabreclaim(void);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
@@ -124,6 +177,9 @@ void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// stats.c
+void            statsinit(void);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -159,14 +215,20 @@ int             uartgetc(void);
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
+pagetable_t     kvmcreate(void);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
+int             mapsuper(pagetable_t, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
+int             uvmsuper(pagetable_t, uint64, int);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmcow(pagetable_t, uint64);
+int             uvmfault(pagetable_t, uint64, uint64, int);
 void            uvmfree(pagetable_t, uint64);
-void            uvmunmap(pagetable_t, uint64, uint64, int);
+int             uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
@@ -174,6 +236,21 @@ int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 
+// vma.c
+void            vmainit(void);
+int             vmafault(struct proc*, uint64, int);
+int             vmafill(pagetable_t, struct vma*, uint64);
+int             vmadup(struct proc*, struct proc*);
+void            vmafree(struct vma*);
+uint64          vmalimit(struct proc*);
+uint64          vmamap(struct proc*, uint64, int, int, struct file*, uint);
+int             vmaunmap(struct proc*, uint64, uint64);
+void            vmaprefault(uint64, uint64);
+void            vmatext(struct vma*, struct inode*);
+void            textinval(struct inode*);
+int             textreclaim(void);
+int             textstats(char*, int);
+
 // plic.c
 void            plicinit(void);
 void            plicinithart(void);
@@ -182,7 +259,9 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_submit(struct buf **, int, int);
+void            virtio_disk_kick(void);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
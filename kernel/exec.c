@@ -6,8 +6,7 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
-
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
+#include "fcntl.h"
 
 int flags2perm(int flags)
 {
@@ -24,13 +23,16 @@ exec(char *path, char **argv)
 {
   char *s, *last;
   int i, off;
-  uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
+  uint64 a, argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
+  struct vma vma[NVMA], *v;
   struct proc *p = myproc();
 
+  memset(vma, 0, sizeof(vma));
+
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -61,12 +63,31 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr + ph.memsz > TRAPFRAME)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    // don't read the segment now; record where it comes
+    // from, and let page faults fill it in (see vma.c).
+    for(v = vma; v < &vma[NVMA] && v->end; v++)
+      ;
+    if(v == &vma[NVMA])
       goto bad;
+    v->start = ph.vaddr;
+    v->end = PGROUNDUP(ph.vaddr + ph.memsz);
+    v->perm = flags2perm(ph.flags) | PTE_R | PTE_U;
+    v->flags = MAP_PRIVATE;
+    vmatext(v, ip);
+    v->off = ph.off;
+    v->filesz = ph.filesz;
+    if(v->end > sz)
+      sz = v->end;
+    // read the file part of writable segments up front,
+    // so that copyout() into them never needs the file;
+    // only their bss is left to demand-zero faults.
+    if(v->perm & PTE_W){
+      for(a = v->start; a < v->start + v->filesz; a += PGSIZE)
+        if(vmafill(pagetable, v, a) != 0)
+          goto bad;
+    }
   }
   iunlockput(ip);
   end_op();
@@ -121,12 +142,16 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  vmaunmap(p, 0, MAXVA);
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
+  p->stackguard = stackbase - PGSIZE;
+  p->bigheap = p->bigheapend = 0;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  memmove(p->vma, vma, sizeof(vma));
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -134,33 +159,13 @@ exec(char *path, char **argv)
   if(pagetable)
     proc_freepagetable(pagetable, sz);
   if(ip){
+    vmafree(vma);
     iunlockput(ip);
     end_op();
+  } else {
+    begin_op();
+    vmafree(vma);
+    end_op();
   }
   return -1;
 }
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
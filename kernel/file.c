@@ -12,17 +12,22 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
+
+// open files come from a slab cache, so there is no fixed
+// limit on their number; ftable.lock protects their ref counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  kmem_cache_init(&ftable.cache, "file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -31,16 +36,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(&ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -72,6 +72,7 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(&ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -101,6 +102,35 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Sequential reads of f open a read-ahead window, which
+// doubles with each further sequential read, up to READAHEAD
+// blocks; any other read closes it. off is where the read
+// that just finished started. Caller holds f->ip->lock.
+static void
+readahead(struct file *f, uint64 off)
+{
+  uint64 start, end;
+
+  if(off != f->ranext){
+    f->rawin = 0;
+    f->raend = 0;
+  } else if(f->rawin == 0){
+    f->rawin = 4;
+  } else if(f->rawin < READAHEAD){
+    f->rawin *= 2;
+  }
+  f->ranext = f->off;
+  if(f->rawin == 0)
+    return;
+
+  start = f->off > f->raend ? f->off : f->raend;
+  end = f->off + f->rawin*BSIZE;
+  if(end > start){
+    ireadahead(f->ip, start, end - start);
+    f->raend = end;
+  }
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -118,9 +148,15 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
+    // the destination may be an untouched mapping of this
+    // or another file, which can't be filled while we hold
+    // the inode and buffer locks.
+    vmaprefault(addr, n);
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    if((r = readi(f->ip, 1, addr, f->off, n)) > 0){
       f->off += r;
+      readahead(f, f->off - r);
+    }
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -146,25 +182,26 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write as many blocks at a time as one system call
+    // may log, including i-node, extent blocks, allocation
+    // blocks, and slop for non-aligned writes.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = writeimax(log_maxop());
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      int nb = writeiblocks(n1);
+      vmaprefault(addr + i, n1);  // as in fileread()
+      begin_opn(nb);
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
-      end_op();
+      end_opn(nb);
 
       if(r != n1){
         // error from writei
@@ -5,7 +5,10 @@ struct file {
   char writable;
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
-  uint off;          // FD_INODE
+  uint64 off;        // FD_INODE
+  uint64 ranext;     // FD_INODE: where a sequential read would start
+  uint rawin;        // FD_INODE: read-ahead window, in blocks
+  uint64 raend;      // FD_INODE: end of the read-ahead started so far
   short major;       // FD_DEVICE
 };
 
@@ -13,11 +16,27 @@ struct file {
 #define minor(dev)  ((dev) & 0xFFFF)
 #define	mkdev(m,n)  ((uint)((m)<<16| (n)))
 
+// A run of an inode's blocks, and where it is in the file:
+// run idx of the file, starting at block lblk of the file.
+struct runcache {
+  uint idx;
+  uint lblk;
+  struct extent e;    // e.len is 0 if the slot is empty
+};
+
+#define NRUNCACHE 4
+
 // in-memory copy of an inode
 struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // hash bucket; protected by the bucket's lock
+  struct inode *prev;
+  struct inode *lrunext; // unused entries; protected by itable.lock
+  struct inode *lruprev;
+  int onlru;
+  int ntext;          // exec() segments mapping it; see vma.c
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -25,8 +44,14 @@ struct inode {
   short major;
   short minor;
   short nlink;
-  uint size;
-  uint addrs[NDIRECT+1];
+  uint64 size;
+  struct extent ext[NEXTENT];
+  uint extind[2];
+
+  // Runs bmap() found lately, so that it needn't read
+  // extent blocks again for every block.
+  struct runcache rc[NRUNCACHE];
+  int rcnext;         // slot to use next
 };
 
 // map major device number to device functions.
@@ -38,3 +63,4 @@ struct devsw {
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define STATS   2
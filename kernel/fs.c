@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "slab.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
@@ -37,6 +38,9 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+static void bsuminit(int);
+static void isuminit(int);
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,6 +48,8 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bsuminit(dev);
+  isuminit(dev);
 }
 
 // Zero a block.
@@ -59,34 +65,126 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// The on-disk bitmap has a bit per block, set if the block
+// is in use. To save searching it, the kernel keeps a
+// summary in memory: how many blocks each bitmap block says
+// are free, built at boot, and where the last allocation
+// ended. A search starts at the caller's goal, usually the
+// block after the end of the file being written, else where
+// the last allocation ended; skips bitmap blocks that have
+// no free blocks; and looks 32 bits at a time.
 
-// Allocate a zeroed disk block.
-// returns 0 if out of disk space.
-static uint
-balloc(uint dev)
+struct {
+  struct spinlock lock;
+  int nbmap;    // bitmap blocks
+  int *nfree;   // free blocks in each bitmap block
+  uint cursor;  // block after the last allocation
+} bsum;
+
+// Count the free blocks in each bitmap block.
+static void
+bsuminit(int dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  int i, bi;
+
+  initlock(&bsum.lock, "bsum");
+  bsum.nbmap = (sb.size + BPB - 1) / BPB;
+  if(bsum.nbmap > PGSIZE / sizeof(int) || (bsum.nfree = kalloc()) == 0)
+    panic("bsuminit");
+  for(i = 0; i < bsum.nbmap; i++){
+    bsum.nfree[i] = 0;
+    bp = bread(dev, sb.bmapstart + i);
+    for(bi = 0; bi < BPB && i*BPB + bi < sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        bsum.nfree[i]++;
+    brelse(bp);
+  }
+}
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+// Find the first clear bit at or after bit from and
+// before bit to in bitmap w, 32 bits at a time.
+// Returns -1 if there is none.
+static int
+bfind(uint *w, int from, int to)
+{
+  uint x;
+  int i, b;
+
+  for(i = from / 32; i*32 < to; i++){
+    x = ~w[i];
+    if(i == from / 32)
+      x &= ~0U << (from % 32);
+    if(x == 0)
+      continue;
+    for(b = i*32; (x & 1) == 0; b++)
+      x >>= 1;
+    return b < to ? b : -1;
+  }
+  return -1;
+}
+
+// Allocate up to n consecutive zeroed disk blocks, at or
+// after block goal if possible (0 for no preference).
+// Sets *got to how many, and returns the first, or 0 if
+// out of disk space.
+static uint
+balloc_n(uint dev, uint goal, int n, int *got)
+{
+  struct buf *bp;
+  int i, k, bb, bi, to, m;
+  uint b;
+
+  acquire(&bsum.lock);
+  if(goal == 0 || goal >= sb.size)
+    goal = bsum.cursor;
+  release(&bsum.lock);
+
+  // the goal's bitmap block first, and again at the
+  // end, for any free blocks before the goal in it.
+  for(k = 0; k <= bsum.nbmap; k++){
+    bb = (goal / BPB + k) % bsum.nbmap;
+    if(bsum.nfree[bb] == 0)
+      continue;
+    bp = bread(dev, sb.bmapstart + bb);
+    to = sb.size - bb*BPB < BPB ? sb.size - bb*BPB : BPB;
+    bi = bfind((uint*)bp->data, k == 0 ? goal % BPB : 0, to);
+    if(bi < 0){
+      brelse(bp);
+      continue;
+    }
+    for(m = 0; m < n && bi + m < to; m++){
+      if(bp->data[(bi+m)/8] & (1 << ((bi+m) % 8)))
+        break;
+      bp->data[(bi+m)/8] |= 1 << ((bi+m) % 8);  // Mark block in use.
     }
+    log_write(bp);
+    acquire(&bsum.lock);
+    bsum.nfree[bb] -= m;
+    b = bb*BPB + bi;
+    bsum.cursor = b + m;
+    release(&bsum.lock);
     brelse(bp);
+    for(i = 0; i < m; i++)
+      bzero(dev, b + i);
+    *got = m;
+    return b;
   }
   printf("balloc: out of blocks\n");
   return 0;
 }
 
+// Allocate a zeroed disk block.
+// returns 0 if out of disk space.
+static uint
+balloc(uint dev)
+{
+  int got;
+
+  return balloc_n(dev, 0, 1, &got);
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -101,6 +199,9 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  acquire(&bsum.lock);
+  bsum.nfree[b / BPB]++;
+  release(&bsum.lock);
   brelse(bp);
 }
 
@@ -129,18 +230,19 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to a table entry (open files and
+//   current directories). iget() finds or creates a table
+//   entry and increments its ref; iput() decrements ref.
+//   An entry whose ref is zero is unused, but stays in the
+//   table, still valid, until it is among the least
+//   recently used of more than NINODE such entries.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid if it frees the inode on disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -164,60 +266,266 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The table is a hash table keyed by (dev, inum). Its entries
+// are allocated from a slab cache, so it grows as needed, and
+// unused entries are kept on an LRU list, so that a file
+// opened again soon needn't be read from disk again.
+//
+// Each hash bucket's lock protects the bucket's list, and
+// ip->ref of the entries in it; one must hold it to find an
+// entry or change its ref. itable.lock protects the LRU list
+// and is held to add an entry to the table or take one out;
+// take it before any bucket lock. ip->dev and ip->inum don't
+// change while the entry is in the table.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIBUCKET 61
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIBUCKET)
+
 struct {
-  struct spinlock lock;
-  struct inode inode[NINODE];
+  struct spinlock lock;    // guards misses and the LRU list
+  struct kmem_cache cache;
+  int ninode;              // entries in the table
+
+  // Entries whose ref fell to zero, least recently used
+  // first, through ip->lrunext. An entry that iget() has
+  // since taken stays on the list until iput() or
+  // ievict() looks at it.
+  struct inode *lruhead;
+  struct inode *lrutail;
+  int nlru;
+
+  // Entries in each hash bucket, through ip->next.
+  struct {
+    struct spinlock lock;
+    struct inode *head;
+  } bucket[NIBUCKET];
+
+  uint nhit;
+  uint nmiss;
+  uint nevict;
 } itable;
 
 void
 iinit()
 {
-  int i = 0;
-  
+  int i;
+
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  kmem_cache_init(&itable.cache, "inode", sizeof(struct inode));
+  for(i = 0; i < NIBUCKET; i++)
+    initlock(&itable.bucket[i].lock, "itable.bucket");
+}
+
+// Add ip to the tail of the LRU list. Caller holds itable.lock.
+static void
+lru_push(struct inode *ip)
+{
+  ip->onlru = 1;
+  ip->lrunext = 0;
+  ip->lruprev = itable.lrutail;
+  if(itable.lrutail)
+    itable.lrutail->lrunext = ip;
+  else
+    itable.lruhead = ip;
+  itable.lrutail = ip;
+  itable.nlru++;
+}
+
+// Take ip off the LRU list. Caller holds itable.lock.
+static void
+lru_remove(struct inode *ip)
+{
+  if(ip->lruprev)
+    ip->lruprev->lrunext = ip->lrunext;
+  else
+    itable.lruhead = ip->lrunext;
+  if(ip->lrunext)
+    ip->lrunext->lruprev = ip->lruprev;
+  else
+    itable.lrutail = ip->lruprev;
+  ip->onlru = 0;
+  itable.nlru--;
+}
+
+// Take ip out of bucket h, whose lock the caller holds.
+static void
+ibucket_remove(int h, struct inode *ip)
+{
+  if(ip->prev)
+    ip->prev->next = ip->next;
+  else
+    itable.bucket[h].head = ip->next;
+  if(ip->next)
+    ip->next->prev = ip->prev;
+}
+
+// Free the least recently used entries while more than
+// NINODE are unused. Caller holds itable.lock.
+static void
+ievict(void)
+{
+  struct inode *ip;
+  int h;
+
+  while(itable.nlru > NINODE){
+    ip = itable.lruhead;
+    lru_remove(ip);
+    h = IHASH(ip->dev, ip->inum);
+    acquire(&itable.bucket[h].lock);
+    if(ip->ref != 0){
+      // in use again; iput() will put it back.
+      release(&itable.bucket[h].lock);
+      continue;
+    }
+    ibucket_remove(h, ip);
+    release(&itable.bucket[h].lock);
+    kmem_cache_free(&itable.cache, ip);
+    itable.ninode--;
+    itable.nevict++;
   }
 }
 
 static struct inode* iget(uint dev, uint inum);
 
-// Allocate an inode on device dev.
+// The kernel keeps a bitmap of which inodes are allocated,
+// built at boot from the inode blocks, so that ialloc()
+// needn't read them all to find a free one.
+
+struct {
+  struct spinlock lock;
+  uint *used;   // a bit per inode, set if allocated
+  int nfree;    // free inodes
+  int nalloc;   // allocations
+  int nhit;     // allocations in the hint's inode block
+  int nscan;    // inodes skipped past the hint
+} isum;
+
+// Mark the allocated inodes.
+static void
+isuminit(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  int inum;
+
+  initlock(&isum.lock, "isum");
+  if(sb.ninodes > PGSIZE*8 || (isum.used = kalloc()) == 0)
+    panic("isuminit");
+  memset(isum.used, 0, PGSIZE);
+  isum.used[0] = 1;  // inode 0 is never allocated
+  bp = 0;
+  for(inum = 1; inum < sb.ninodes; inum++){
+    if(bp == 0 || inum % IPB == 0){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, IBLOCK(inum, sb));
+    }
+    dip = (struct dinode*)bp->data + inum%IPB;
+    if(dip->type != 0)
+      isum.used[inum/32] |= 1 << (inum % 32);
+    else
+      isum.nfree++;
+  }
+  if(bp)
+    brelse(bp);
+}
+
+// Allocate an inode on device dev, the first free one at
+// or after inode near if possible, so that a file's inode
+// shares a block with its directory's.
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode,
 // or NULL if there is no free inode.
 struct inode*
-ialloc(uint dev, short type)
+ialloc(uint dev, short type, uint near)
 {
   int inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
+  if(near >= sb.ninodes)
+    near = 0;
+
+  acquire(&isum.lock);
+  if(isum.nfree == 0 ||
+     ((inum = bfind(isum.used, near, sb.ninodes)) < 0 &&
+      (inum = bfind(isum.used, 0, near)) < 0)){
+    release(&isum.lock);
+    printf("ialloc: no inodes\n");
+    return 0;
+  }
+  isum.used[inum/32] |= 1 << (inum % 32);
+  isum.nfree--;
+  isum.nalloc++;
+  if(near && IBLOCK(inum, sb) == IBLOCK(near, sb))
+    isum.nhit++;
+  isum.nscan += (inum - near + sb.ninodes) % sb.ninodes;
+  release(&isum.lock);
+
+  bp = bread(dev, IBLOCK(inum, sb));
+  dip = (struct dinode*)bp->data + inum%IPB;
+  if(dip->type != 0)
+    panic("ialloc: not free");
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  log_write(bp);   // mark it allocated on the disk
+  brelse(bp);
+  return iget(dev, inum);
+}
+
+// Note that inode inum is free again, once its
+// zero type is written.
+static void
+ifree(uint inum)
+{
+  acquire(&isum.lock);
+  if((isum.used[inum/32] & (1 << (inum % 32))) == 0)
+    panic("ifree");
+  isum.used[inum/32] &= ~(1 << (inum % 32));
+  isum.nfree++;
+  release(&isum.lock);
+}
+
+// Look for inode inum on device dev in bucket h,
+// whose lock the caller holds. Takes a reference.
+static struct inode*
+ilookup(int h, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = itable.bucket[h].head; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      ip->ref++;
+      return ip;
     }
-    brelse(bp);
   }
-  printf("ialloc: no inodes\n");
   return 0;
 }
 
+int
+fsstats(char *buf, int sz)
+{
+  int n = 0, i, nb = 0;
+
+  acquire(&bsum.lock);
+  for(i = 0; i < bsum.nbmap; i++)
+    nb += bsum.nfree[i];
+  release(&bsum.lock);
+  acquire(&isum.lock);
+  n += snprintf(buf+n, sz-n, "--- fs: free blocks %d inodes %d ialloc %d hit %d scan %d\n",
+                nb, isum.nfree, isum.nalloc, isum.nhit, isum.nscan);
+  release(&isum.lock);
+  acquire(&itable.lock);
+  n += snprintf(buf+n, sz-n, "--- itable: inodes %d unused %d hit %d miss %d evict %d\n",
+                itable.ninode, itable.nlru, itable.nhit, itable.nmiss, itable.nevict);
+  release(&itable.lock);
+  return n;
+}
+
 // Copy a modified in-memory inode to disk.
 // Must be called after every change to an ip->xxx field
 // that lives on disk.
@@ -235,7 +543,8 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
+  memmove(dip->extind, ip->extind, sizeof(ip->extind));
   log_write(bp);
   brelse(bp);
 }
@@ -246,31 +555,48 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
+  int h;
+
+  h = IHASH(dev, inum);
+  acquire(&itable.bucket[h].lock);
+  ip = ilookup(h, dev, inum);
+  release(&itable.bucket[h].lock);
+  if(ip){
+    __sync_fetch_and_add(&itable.nhit, 1);
+    return ip;
+  }
 
+  // Not in the table. Check again holding itable.lock,
+  // so that an inode can't end up in the table twice.
   acquire(&itable.lock);
-
-  // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  acquire(&itable.bucket[h].lock);
+  if((ip = ilookup(h, dev, inum)) != 0){
+    release(&itable.bucket[h].lock);
+    release(&itable.lock);
+    __sync_fetch_and_add(&itable.nhit, 1);
+    return ip;
   }
+  release(&itable.bucket[h].lock);
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  if((ip = kmem_cache_alloc(&itable.cache)) == 0)
     panic("iget: no inodes");
-
-  ip = empty;
+  initsleeplock(&ip->lock, "inode");
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->onlru = 0;
+  ip->ntext = 0;
+  acquire(&itable.bucket[h].lock);
+  ip->prev = 0;
+  ip->next = itable.bucket[h].head;
+  if(ip->next)
+    ip->next->prev = ip;
+  itable.bucket[h].head = ip;
+  release(&itable.bucket[h].lock);
+  itable.ninode++;
+  itable.nmiss++;
   release(&itable.lock);
 
   return ip;
@@ -281,9 +607,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  int h = IHASH(ip->dev, ip->inum);
+
+  acquire(&itable.bucket[h].lock);
   ip->ref++;
-  release(&itable.lock);
+  release(&itable.bucket[h].lock);
   return ip;
 }
 
@@ -308,7 +636,10 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    memmove(ip->extind, dip->extind, sizeof(ip->extind));
+    memset(ip->rc, 0, sizeof(ip->rc));
+    ip->rcnext = 0;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -327,8 +658,9 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry
+// joins the LRU list of unused entries, or is freed if
+// it no longer holds an inode.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -336,28 +668,58 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  int h = IHASH(ip->dev, ip->inum);
 
-  if(ip->ref == 1 && ip->valid && ip->nlink == 0){
+  acquire(&itable.bucket[h].lock);
+
+  if(ip->ref > 1){
+    ip->ref--;
+    release(&itable.bucket[h].lock);
+    return;
+  }
+
+  if(ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
 
     // ip->ref == 1 means no other process can have ip locked,
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&itable.bucket[h].lock);
 
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
+    ifree(ip->inum);
     ip->valid = 0;
 
     releasesleep(&ip->lock);
-
-    acquire(&itable.lock);
+  } else {
+    release(&itable.bucket[h].lock);
   }
 
-  ip->ref--;
+  // The entry may be leaving the table or joining the
+  // LRU list, so take itable.lock, then look at ref again:
+  // iget() may have found the entry meanwhile.
+  acquire(&itable.lock);
+  acquire(&itable.bucket[h].lock);
+  if(--ip->ref > 0){
+    release(&itable.bucket[h].lock);
+    release(&itable.lock);
+    return;
+  }
+  if(ip->onlru)
+    lru_remove(ip);
+  if(!ip->valid){
+    ibucket_remove(h, ip);
+    release(&itable.bucket[h].lock);
+    kmem_cache_free(&itable.cache, ip);
+    itable.ninode--;
+  } else {
+    lru_push(ip);
+    release(&itable.bucket[h].lock);
+    ievict();
+  }
   release(&itable.lock);
 }
 
@@ -372,82 +734,262 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
-
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-// returns 0 if out of disk space.
+// in blocks on the disk, in runs of consecutive blocks.
+// The first NEXTENT runs are listed in ip->ext[]. The rest
+// are listed in extent blocks, EPB to a block: the next
+// NINDIRECT*EPB through block ip->extind[0], which lists
+// extent blocks, and the rest through ip->extind[1], which
+// lists blocks that list extent blocks. Files have no
+// holes, so a run's place in the file is the sum of the
+// lengths of the runs before it.
+
+// Find the extent block holding run i of ip, allocating
+// it, and the blocks that lead to it, if alloc. Returns
+// 0 if there's no such block, or if out of disk space.
 static uint
-bmap(struct inode *ip, uint bn)
+eblock(struct inode *ip, uint i, int alloc)
 {
-  uint addr, *a;
+  uint *root, addr, next, per, *a;
   struct buf *bp;
-
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[bn] = addr;
-    }
-    return addr;
+  int depth;
+
+  i -= NEXTENT;
+  if(i < NINDIRECT*EPB){
+    root = &ip->extind[0];
+    depth = 1;
+  } else if((i -= NINDIRECT*EPB) < NINDIRECT*NINDIRECT*EPB){
+    root = &ip->extind[1];
+    depth = 2;
+  } else {
+    return 0;
   }
-  bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
+  if((addr = *root) == 0){
+    if(!alloc || (addr = balloc(ip->dev)) == 0)
+      return 0;
+    *root = addr;
+  }
+  for(per = EPB; depth > 1; depth--)
+    per *= NINDIRECT;
+  for(; per >= EPB; per /= NINDIRECT){
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr){
-        a[bn] = addr;
+    if((next = a[i / per % NINDIRECT]) == 0 && alloc){
+      if((next = balloc(ip->dev)) != 0){
+        a[i / per % NINDIRECT] = next;
         log_write(bp);
       }
     }
     brelse(bp);
-    return addr;
+    if((addr = next) == 0)
+      return 0;
   }
+  return addr;
+}
 
-  panic("bmap: out of range");
+// Read run i of ip into *e. Returns 0 if ip has
+// fewer than i+1 runs.
+static int
+eget(struct inode *ip, uint i, struct extent *e)
+{
+  struct buf *bp;
+  uint addr;
+
+  if(i < NEXTENT){
+    *e = ip->ext[i];
+    return e->len != 0;
+  }
+
+  if((addr = eblock(ip, i, 0)) == 0)
+    return 0;
+  bp = bread(ip->dev, addr);
+  *e = ((struct extent*)bp->data)[(i - NEXTENT) % EPB];
+  brelse(bp);
+  return e->len != 0;
 }
 
-// Truncate inode (discard contents).
-// Caller must hold ip->lock.
-void
-itrunc(struct inode *ip)
+// Set run i of ip to *e, allocating extent blocks
+// if necessary. Returns -1 if out of disk space.
+static int
+eput(struct inode *ip, uint i, struct extent *e)
 {
-  int i, j;
   struct buf *bp;
-  uint *a;
+  uint addr;
+
+  if(i < NEXTENT){
+    ip->ext[i] = *e;
+    return 0;
+  }
+
+  if((addr = eblock(ip, i, 1)) == 0)
+    return -1;
+  bp = bread(ip->dev, addr);
+  ((struct extent*)bp->data)[(i - NEXTENT) % EPB] = *e;
+  log_write(bp);
+  brelse(bp);
+  return 0;
+}
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
+// Find the run holding the nth block of ip, through the
+// runs bmap() found lately. Returns its slot in ip->rc,
+// and sets *found; if there's no such block, returns the
+// last run, if any, with *found 0. A sequential reader
+// or writer only reads each run once, even with read-ahead
+// going on ahead of it.
+static struct runcache*
+efind(struct inode *ip, uint bn, int *found)
+{
+  struct runcache *r, *best = 0;
+  struct extent e;
+
+  for(r = ip->rc; r < ip->rc + NRUNCACHE; r++){
+    if(r->e.len == 0)
+      continue;
+    if(bn >= r->lblk && bn < r->lblk + r->e.len){
+      *found = 1;
+      return r;
     }
+    if(r->lblk <= bn && (best == 0 || r->lblk > best->lblk))
+      best = r;
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+  // walk on from the closest run before bn, or from
+  // the first run, leaving the one before cached.
+  r = &ip->rc[ip->rcnext];
+  ip->rcnext = (ip->rcnext + 1) % NRUNCACHE;
+  if(best){
+    *r = *best;
+  } else {
+    r->idx = 0;
+    r->lblk = 0;
+    if(!eget(ip, 0, &r->e)){
+      r->e.len = 0;
+      *found = 0;
+      return r;
+    }
+  }
+  while(bn >= r->lblk + r->e.len){
+    if(!eget(ip, r->idx + 1, &e)){
+      *found = 0;
+      return r;
+    }
+    r->lblk += r->e.len;
+    r->idx++;
+    r->e = e;
+  }
+  *found = 1;
+  return r;
+}
+
+// Return the disk block address of the nth block in inode ip,
+// the first of n blocks the caller is about to write. If there
+// is no such block, bmap allocates up to n, as close after the
+// last run as it can, extending the last run if they follow it.
+// returns 0 if out of disk space.
+static uint
+bmap(struct inode *ip, uint bn, uint n)
+{
+  struct runcache *r, *q;
+  struct extent e;
+  uint addr, idx;
+  int found, got;
+
+  r = efind(ip, bn, &found);
+  if(found)
+    return r->e.start + (bn - r->lblk);
+
+  // bn is past the end; files grow a block at a time.
+  if(bn != r->lblk + r->e.len)
+    panic("bmap: hole");
+  addr = balloc_n(ip->dev, r->e.len ? r->e.start + r->e.len : 0, n, &got);
+  if(addr == 0)
+    return 0;
+
+  // the last run changes, so forget any other copy of it.
+  for(q = ip->rc; q < ip->rc + NRUNCACHE; q++)
+    if(q != r)
+      q->e.len = 0;
+
+  if(r->e.len && addr == r->e.start + r->e.len){
+    r->e.len += got;
+    eput(ip, r->idx, &r->e);  // can't fail: its block exists
+    return addr;
+  }
+
+  e.start = addr;
+  e.len = got;
+  idx = r->e.len ? r->idx + 1 : 0;
+  if(eput(ip, idx, &e) < 0){
+    while(got-- > 0)
+      bfree(ip->dev, addr + got);
+    return 0;
+  }
+  r->idx = idx;
+  r->lblk = bn;
+  r->e = e;
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip,
+// or 0 if there is no such block. Unlike bmap(), never
+// allocates.
+static uint
+bpeek(struct inode *ip, uint bn)
+{
+  struct runcache *r;
+  int found;
+
+  r = efind(ip, bn, &found);
+  if(!found)
+    return 0;
+  return r->e.start + (bn - r->lblk);
+}
+
+// Free block addr, which lists blocks depth levels
+// above extent blocks, and the blocks it leads to.
+static void
+efree(uint dev, uint addr, int depth)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  if(depth > 0){
+    bp = bread(dev, addr);
     a = (uint*)bp->data;
     for(j = 0; j < NINDIRECT; j++){
       if(a[j])
-        bfree(ip->dev, a[j]);
+        efree(dev, a[j], depth-1);
     }
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
+  bfree(dev, addr);
+}
+
+// Truncate inode (discard contents).
+// Caller must hold ip->lock.
+void
+itrunc(struct inode *ip)
+{
+  struct extent e;
+  uint i, j;
+
+  textinval(ip);
+  for(i = 0; eget(ip, i, &e); i++){
+    for(j = 0; j < e.len; j++)
+      bfree(ip->dev, e.start + j);
+  }
+  memset(ip->ext, 0, sizeof(ip->ext));
 
+  for(i = 0; i < 2; i++){
+    if(ip->extind[i]){
+      efree(ip->dev, ip->extind[i], i+1);
+      ip->extind[i] = 0;
+    }
+  }
+
+  memset(ip->rc, 0, sizeof(ip->rc));
+  ip->rcnext = 0;
   ip->size = 0;
   iupdate(ip);
 }
@@ -469,7 +1011,7 @@ stati(struct inode *ip, struct stat *st)
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
 int
-readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+readi(struct inode *ip, int user_dst, uint64 dst, uint64 off, uint n)
 {
   uint tot, m;
   struct buf *bp;
@@ -480,7 +1022,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
+    uint addr = bpeek(ip, off/BSIZE);
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
@@ -495,6 +1037,47 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Start reading the blocks of ip that hold bytes [off, off+n)
+// into the buffer cache, up to READAHEAD of them, without
+// waiting for the disk. Caller must hold ip->lock.
+void
+ireadahead(struct inode *ip, uint64 off, uint n)
+{
+  uint blocknos[READAHEAD], bn, addr;
+  int m = 0;
+
+  if(off >= ip->size || n == 0)
+    return;
+  if(off + n > ip->size || off + n < off)
+    n = ip->size - off;
+
+  for(bn = off/BSIZE; bn <= (off+n-1)/BSIZE && m < READAHEAD; bn++){
+    if((addr = bpeek(ip, bn)) == 0)
+      break;
+    blocknos[m++] = addr;
+  }
+  breadahead(ip->dev, blocknos, m);
+}
+
+// The most log blocks writei() of n bytes may write.
+int
+writeiblocks(uint n)
+{
+  return WRITEIBLOCKS(n);
+}
+
+// The most bytes writei() may write, a whole number of
+// blocks, in a system call that may log nlog blocks.
+uint
+writeimax(int nlog)
+{
+  uint n = nlog / 2 * BSIZE;
+
+  while(n > 0 && writeiblocks(n) > nlog)
+    n -= BSIZE;
+  return n;
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -503,18 +1086,21 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 // If the return value is less than the requested n,
 // there was an error of some kind.
 int
-writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
+writei(struct inode *ip, int user_src, uint64 src, uint64 off, uint n)
 {
   uint tot, m;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(off + n > (uint64)MAXFILE*BSIZE)
     return -1;
+  if(ip->ntext > 0)
+    return -1;  // a running program pages its text in from ip
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    uint addr = bmap(ip, off/BSIZE);
+    // the blocks the rest of the write touches.
+    uint addr = bmap(ip, off/BSIZE, (off + n - tot - 1)/BSIZE - off/BSIZE + 1);
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
@@ -530,9 +1116,14 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   if(off > ip->size)
     ip->size = off;
 
+  // only now, since a page fault in the copy above
+  // could have cached a page from before it.
+  if(tot > 0)
+    textinval(ip);
+
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
+  // block to ip->ext[].
   iupdate(ip);
 
   return tot;
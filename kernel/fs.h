@@ -22,11 +22,33 @@ struct superblock {
   uint bmapstart;    // Block number of first free map block
 };
 
-#define FSMAGIC 0x10203040
+#define FSMAGIC 0x10203041
 
-#define NDIRECT 12
+// A run of len data blocks starting at block start.
+// A file's runs hold its blocks in order; a run with
+// len 0 ends the list.
+struct extent {
+  uint start;
+  uint len;
+};
+
+#define NEXTENT 5   // runs in the inode
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define EPB (BSIZE / sizeof(struct extent))  // runs per extent block
+#define MAXEXTENT (NEXTENT + NINDIRECT*EPB + NINDIRECT*NINDIRECT*EPB)
+#define MAXFILE MAXEXTENT  // blocks, even if each is a run of its own
+
+// The most log blocks writei() of n bytes may write:
+// each block the bytes may touch, the extent blocks
+// their runs may go in, and the two levels of blocks
+// above those, each with a bitmap block; and the i-node.
+#define WRITEIBLOCKS(n) \
+  (2 * (((n) + BSIZE - 1) / BSIZE + 1 + (((n) + BSIZE - 1) / BSIZE + 1) / EPB + 2 + 2) + 1)
+
+// The smallest log, after its header block. A system call
+// may log a quarter of it (see log_maxop()), which must be
+// room for MAXOPBLOCKS, and for a write() of one block.
+#define LOGMIN (4 * (MAXOPBLOCKS > WRITEIBLOCKS(BSIZE) ? MAXOPBLOCKS : WRITEIBLOCKS(BSIZE)))
 
 // On-disk inode structure
 struct dinode {
@@ -34,8 +56,9 @@ struct dinode {
   short major;          // Major device number (T_DEVICE only)
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
-  uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint64 size;          // Size of file (bytes)
+  struct extent ext[NEXTENT]; // The first runs of data blocks
+  uint extind[2];       // Doubly- and triply-indirect blocks of runs
 };
 
 // Inodes per block.
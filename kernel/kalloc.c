@@ -1,14 +1,53 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous runs of 2^order pages.
+//
+// Free memory is kept by a binary buddy allocator over
+// KERNBASE..PHYSTOP: a free block of order k is 2^k pages,
+// aligned to its own size, and is merged with its buddy
+// (the other half of the enclosing order k+1 block)
+// whenever both are free.
+//
+// Single pages are the common case, so each hart also keeps
+// a private cache of free pages and the kalloc()/kfree() path
+// takes only that hart's lock. Pages move between a hart's
+// cache and the buddy allocator KBATCH at a time: a hart
+// whose cache is empty refills a batch, and a hart whose
+// cache grows past KHIGH drains a batch back. If the buddy
+// allocator is empty too, kalloc() steals half of another
+// hart's cache.
+//
+// Every allocated page has a reference count, so that fork()
+// can share pages copy-on-write: kpage_ref() adds a reference,
+// and kfree() drops one, freeing the page with the last.
+//
+// Pages are not cleared on allocation or free (except with
+// -DKJUNK, which fills them with junk to catch dangling refs).
+// Callers that need zeroed memory use kalloc_zeroed(), which
+// takes pages from a pool that idle harts keep topped up
+// with pre-zeroed pages (see kzero_refill()).
 
 #include "types.h"
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
 #include "riscv.h"
+#include "proc.h"
 #include "defs.h"
 
+#define KBATCH  32          // pages moved per refill or drain
+#define KHIGH   (4*KBATCH)  // drain a hart's cache above this
+#define KZERO   256         // pre-zeroed pages to keep ready
+#define KZBATCH 8           // pages zeroed per idle refill
+
+#define NPAGE    ((PHYSTOP - KERNBASE) / PGSIZE)
+#define NOTFREE  0xff       // kmem.order[] of a page that doesn't start a free block
+
+// page number of pa, counted from KERNBASE.
+#define PAGENO(pa)  (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PAGEADDR(i) (KERNBASE + (uint64)(i) * PGSIZE)
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -18,15 +57,128 @@ struct run {
   struct run *next;
 };
 
+// a free buddy block, stored in the block's first page.
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct block free[MAXORDER+1]; // circular list of free blocks, per order
+  int nfree[MAXORDER+1];         // length of each list
+  uchar order[NPAGE];            // order of the free block at each page, or NOTFREE
 } kmem;
 
+// references to each allocated page, indexed by PAGENO().
+// updated with atomic instructions rather than under a lock.
+static int kref[NPAGE];
+
+// per-hart page caches, indexed by cpuid().
+struct kcpu {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+  uint nrefill;  // batches taken from the buddy allocator
+  uint ndrain;   // batches given back to the buddy allocator
+  uint nsteal;   // batches taken from other harts
+} kcpu[NCPU];
+
+// pool of pre-zeroed pages for kalloc_zeroed().
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+  uint nhit;     // kalloc_zeroed() served from the pool
+  uint nmiss;    // kalloc_zeroed() had to zero a page itself
+  uint nzeroed;  // pages zeroed by idle harts
+} kzero;
+
+// Put the free block at pa on kmem's order-k list.
+// Caller holds kmem.lock.
+static void
+bd_push(uint64 pa, int k)
+{
+  struct block *b = (struct block*)pa;
+
+  b->next = kmem.free[k].next;
+  b->prev = &kmem.free[k];
+  kmem.free[k].next->prev = b;
+  kmem.free[k].next = b;
+  kmem.nfree[k]++;
+  kmem.order[PAGENO(pa)] = k;
+}
+
+// Take the free block b off kmem's order-k list.
+// Caller holds kmem.lock.
+static void
+bd_remove(struct block *b, int k)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  kmem.nfree[k]--;
+  kmem.order[PAGENO(b)] = NOTFREE;
+}
+
+// Allocate a block of 2^k pages, splitting a larger
+// block if necessary. Returns 0 if none is free.
+// Caller holds kmem.lock.
+static void*
+bd_alloc(int k)
+{
+  struct block *b;
+  int j;
+
+  for(j = k; j <= MAXORDER; j++)
+    if(kmem.nfree[j] > 0)
+      break;
+  if(j > MAXORDER)
+    return 0;
+
+  b = kmem.free[j].next;
+  bd_remove(b, j);
+
+  // give the upper halves back until b is the right size.
+  while(j > k){
+    j--;
+    bd_push((uint64)b + ((uint64)PGSIZE << j), j);
+  }
+  return b;
+}
+
+// Free the block of 2^k pages at pa, merging it
+// with its buddy for as long as the buddy is free.
+// Caller holds kmem.lock.
+static void
+bd_free(uint64 pa, int k)
+{
+  uint64 i, bi;
+
+  while(k < MAXORDER){
+    i = PAGENO(pa);
+    bi = i ^ (1L << k);
+    if(bi + (1L << k) > NPAGE || kmem.order[bi] != k)
+      break;
+    bd_remove((struct block*)PAGEADDR(bi), k);
+    if(bi < i)
+      pa = PAGEADDR(bi);
+    k++;
+  }
+  bd_push(pa, k);
+}
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  for(int k = 0; k <= MAXORDER; k++){
+    kmem.free[k].next = &kmem.free[k];
+    kmem.free[k].prev = &kmem.free[k];
+  }
+  memset(kmem.order, NOTFREE, sizeof(kmem.order));
+  initlock(&kzero.lock, "kzero");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kcpu[i].lock, "kmem_cpu");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,31 +187,160 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    kref[PAGENO(p)] = 1;
     kfree(p);
+  }
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
+// Detach up to max pages from the front of *list.
+// Returns the detached chain (null-terminated) and
+// sets *tail to its last page and *n to its length.
+// Caller holds the lock protecting *list.
+static struct run*
+takebatch(struct run **list, int max, struct run **tail, int *n)
+{
+  struct run *head, *r;
+  int i;
+
+  head = *list;
+  if(head == 0 || max <= 0){
+    *tail = 0;
+    *n = 0;
+    return 0;
+  }
+  r = head;
+  for(i = 1; i < max && r->next; i++)
+    r = r->next;
+  *list = r->next;
+  r->next = 0;
+  *tail = r;
+  *n = i;
+  return head;
+}
+
+// Refill hart id's empty cache and return one page from it,
+// or 0 if there is no free memory anywhere.
+// Interrupts must be disabled.
+static struct run*
+krefill(int id)
+{
+  struct run *head, *tail, *r;
+  int n;
+
+  head = tail = 0;
+  acquire(&kmem.lock);
+  for(n = 0; n < KBATCH; n++){
+    if((r = bd_alloc(0)) == 0)
+      break;
+    r->next = 0;
+    if(tail)
+      tail->next = r;
+    else
+      head = r;
+    tail = r;
+  }
+  release(&kmem.lock);
+
+  if(head){
+    kcpu[id].nrefill++;
+  } else {
+    // the buddy allocator is empty too;
+    // steal half of some other hart's cache.
+    for(int i = 0; i < NCPU && head == 0; i++){
+      if(i == id)
+        continue;
+      acquire(&kcpu[i].lock);
+      head = takebatch(&kcpu[i].freelist, (kcpu[i].nfree+1)/2, &tail, &n);
+      kcpu[i].nfree -= n;
+      release(&kcpu[i].lock);
+    }
+    if(head == 0)
+      return 0;
+    kcpu[id].nsteal++;
+  }
+
+  // keep the first page for the caller, cache the rest.
+  if(head->next){
+    acquire(&kcpu[id].lock);
+    tail->next = kcpu[id].freelist;
+    kcpu[id].freelist = head->next;
+    kcpu[id].nfree += n - 1;
+    release(&kcpu[id].lock);
+  }
+  return head;
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page is freed when its last reference goes.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *head, *tail;
+  int id, n, ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((ref = __sync_sub_and_fetch(&kref[PAGENO(pa)], 1)) > 0)
+    return;
+  if(ref < 0)
+    panic("kfree: not allocated");
+
+#ifdef KJUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+
+  acquire(&kcpu[id].lock);
+  r->next = kcpu[id].freelist;
+  kcpu[id].freelist = r;
+  kcpu[id].nfree++;
+  head = 0;
+  if(kcpu[id].nfree > KHIGH){
+    head = takebatch(&kcpu[id].freelist, KBATCH, &tail, &n);
+    kcpu[id].nfree -= n;
+    kcpu[id].ndrain++;
+  }
+  release(&kcpu[id].lock);
+
+  if(head){
+    acquire(&kmem.lock);
+    while(head){
+      r = head;
+      head = r->next;
+      bd_free((uint64)r, 0);
+    }
+    release(&kmem.lock);
+  }
+
+  pop_off();
+}
+
+// Memory has run out. If the caller holds no spinlocks,
+// ask the caches built on top of kalloc() to give back
+// the pages they can spare. Returns the number of pages
+// given back.
+static int
+kreclaim(void)
+{
+  int nolocks;
+
+  push_off();
+  nolocks = mycpu()->noff == 1;
+  pop_off();
+  if(!nolocks)
+    return 0;
+  bcachereclaim();  // its buffers go back with the slabs
+  return slabreclaim() + textreclaim();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +350,254 @@ void *
 kalloc(void)
 {
   struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
+
+  acquire(&kcpu[id].lock);
+  r = kcpu[id].freelist;
+  if(r){
+    kcpu[id].freelist = r->next;
+    kcpu[id].nfree--;
+  }
+  release(&kcpu[id].lock);
+
+  if(r == 0)
+    r = krefill(id);
+
+  pop_off();
+
+  if(r == 0){
+    // last resort: the pre-zeroed pool.
+    acquire(&kzero.lock);
+    if((r = kzero.freelist) != 0){
+      kzero.freelist = r->next;
+      kzero.nfree--;
+    }
+    release(&kzero.lock);
+  }
+
+  if(r == 0 && kreclaim() > 0)
+    return kalloc();
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
   if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+    kref[PAGENO(r)] = 1;
 
+#ifdef KJUNK
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
   return (void*)r;
 }
+
+// Allocate one zero-filled 4096-byte page.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  if((r = kzero.freelist) != 0){
+    kzero.freelist = r->next;
+    kzero.nfree--;
+    kzero.nhit++;
+  } else {
+    kzero.nmiss++;
+  }
+  release(&kzero.lock);
+
+  if(r){
+    r->next = 0;  // the only word that isn't zero
+  } else if((r = kalloc()) != 0){
+    memset(r, 0, PGSIZE);
+  }
+  return (void*)r;
+}
+
+// Zero a few pages into the pre-zeroed pool if it is
+// below its target. Called by scheduler() when the hart
+// has nothing else to do; takes no lock while zeroing.
+void
+kzero_refill(void)
+{
+  struct run *r;
+
+  for(int i = 0; i < KZBATCH; i++){
+    if(kzero.nfree >= KZERO)  // racy peek; harmless
+      return;
+    if((r = kalloc()) == 0)
+      return;
+    memset(r, 0, PGSIZE);
+    acquire(&kzero.lock);
+    r->next = kzero.freelist;
+    kzero.freelist = r;
+    kzero.nfree++;
+    kzero.nzeroed++;
+    release(&kzero.lock);
+  }
+}
+
+// Add a reference to the allocated page (or
+// kalloc_order() block) at pa.
+void
+kpage_ref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kpage_ref");
+  if(__sync_fetch_and_add(&kref[PAGENO(pa)], 1) < 1)
+    panic("kpage_ref: not allocated");
+}
+
+// Return the number of references to the page at pa.
+int
+kpage_refcnt(void *pa)
+{
+  return __atomic_load_n(&kref[PAGENO(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Give every hart's cached pages back to the buddy allocator,
+// so that they can merge into larger blocks.
+static void
+kdrainall(void)
+{
+  struct run *head, *tail, *r;
+  int n;
+
+  for(int i = 0; i < NCPU; i++){
+    acquire(&kcpu[i].lock);
+    head = takebatch(&kcpu[i].freelist, kcpu[i].nfree, &tail, &n);
+    kcpu[i].nfree -= n;
+    release(&kcpu[i].lock);
+
+    acquire(&kmem.lock);
+    while(head){
+      r = head;
+      head = r->next;
+      bd_free((uint64)r, 0);
+    }
+    release(&kmem.lock);
+  }
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their total size. Returns 0 if the memory cannot
+// be allocated. kalloc_order(0) is equivalent to kalloc().
+void *
+kalloc_order(int order)
+{
+  void *pa;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kalloc_order");
+  if(order == 0)
+    return kalloc();
+
+  acquire(&kmem.lock);
+  pa = bd_alloc(order);
+  release(&kmem.lock);
+
+  if(pa == 0){
+    // single pages parked in per-hart caches may
+    // be all that keeps a large block from forming.
+    kdrainall();
+    acquire(&kmem.lock);
+    pa = bd_alloc(order);
+    release(&kmem.lock);
+  }
+
+  if(pa)
+    kref[PAGENO(pa)] = 1;
+#ifdef KJUNK
+  if(pa)
+    memset(pa, 5, (uint64)PGSIZE << order); // fill with junk
+#endif
+  return pa;
+}
+
+// Allocate 2^order contiguous, aligned pages for a caller
+// that can make do with single pages if there's no such
+// block free: unlike kalloc_order(), doesn't go to the
+// trouble of draining the per-hart caches. Each page gets
+// a reference count of its own, as if from kalloc(), and
+// is freed with kfree().
+void *
+kalloc_contig(int order)
+{
+  char *pa;
+
+  if(order < 1 || order > MAXORDER)
+    panic("kalloc_contig");
+
+  acquire(&kmem.lock);
+  pa = bd_alloc(order);
+  release(&kmem.lock);
+
+  if(pa){
+    for(int i = 0; i < (1 << order); i++)
+      kref[PAGENO(pa) + i] = 1;
+  }
+  return pa;
+}
+
+// Free 2^order contiguous pages at pa, which must
+// have been returned by kalloc_order(order).
+void
+kfree_order(void *pa, int order)
+{
+  int ref;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kfree_order");
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+
+  if(PAGENO(pa) % (1L << order) != 0 || (char*)pa < end ||
+     (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("kfree_order");
+
+  if((ref = __sync_sub_and_fetch(&kref[PAGENO(pa)], 1)) > 0)
+    return;
+  if(ref < 0)
+    panic("kfree_order: not allocated");
+
+#ifdef KJUNK
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, (uint64)PGSIZE << order);
+#endif
+
+  acquire(&kmem.lock);
+  bd_free((uint64)pa, order);
+  release(&kmem.lock);
+}
+
+// Report the buddy allocator's free blocks per order,
+// and lock contention, for the statistics device.
+int
+kallocstats(char *buf, int sz)
+{
+  int n = 0, tot = 0;
+
+  n += snprintf(buf+n, sz-n, "--- kalloc: free blocks per order:");
+  for(int k = 0; k <= MAXORDER; k++){
+    n += snprintf(buf+n, sz-n, " %d", kmem.nfree[k]);
+    tot += kmem.nfree[k] << k;
+  }
+  n += snprintf(buf+n, sz-n, " (%d pages)\n", tot);
+  n += snprint_lock(buf+n, sz-n, &kmem.lock);
+  for(int i = 0; i < NCPU; i++){
+    if(kcpu[i].lock.n == 0)
+      continue;
+    n += snprintf(buf+n, sz-n,
+                  "cpu %d: %d cached, %d refills, %d drains, %d steals, "
+                  "#test-and-set %d #acquire() %d\n",
+                  i, kcpu[i].nfree, kcpu[i].nrefill, kcpu[i].ndrain,
+                  kcpu[i].nsteal, kcpu[i].lock.nts, kcpu[i].lock.n);
+  }
+  n += snprintf(buf+n, sz-n, "zero pool: %d pages, %d hits, %d misses, %d zeroed when idle\n",
+                kzero.nfree, kzero.nhit, kzero.nmiss, kzero.nzeroed);
+  return n;
+}
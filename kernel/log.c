@@ -6,6 +6,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "slab.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
@@ -19,192 +20,601 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// asks for a commit and sleeps until it's made room.
+// begin_op() reserves room for MAXOPBLOCKS; a system call
+// that writes more, such as a big write(), reserves what it
+// needs with begin_opn(), up to log_maxop() blocks.
+//
+// Commits are grouped: end_op() doesn't commit, and a
+// transaction stays open, gathering the updates of system
+// call after system call, until the logger kernel thread
+// closes it: when it has been open COMMITTICKS, when the
+// log is running out of space, or when fsync() asks.
+// Closing a transaction only holds up new system calls
+// while the logger copies its blocks aside (into shadow
+// bufs outside the cache); the next transaction then opens
+// while the logger writes them to the log.
+//
+// Checkpointing is lazy: committed blocks aren't written to
+// their home locations right away, but stay pinned in the
+// cache, and transaction after transaction is appended to
+// the log. Only when the log is half full, or has sat idle
+// for CKPTTICKS, does the logger install the latest version
+// of each logged block, once, and empty the log. It does so
+// with new system calls held up, so that the cache holds
+// exactly what has been committed.
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
-
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// mkfs chooses its size. The on-disk log format:
+//   header block, containing the sequence number of the
+//     first transaction after the last checkpoint
+//   for each transaction since:
+//     descriptor blocks, containing its sequence number, a
+//       checksum, and block #s for block A, B, C, ...
+//     block A
+//     block B
+//     ...
+// A block may appear more than once, for successive
+// transactions; recovery installs them in order.
+// The logger writes a transaction's descriptor and blocks
+// to the log in one burst: it queues all the writes with
+// the disk and only then waits for them, so they may reach
+// the disk in any order, or only some of them. Recovery
+// replays transactions for as long as the next one has the
+// next sequence number and its checksum matches, which it
+// only does once every block of it has been written.
+// Checkpoints write the blocks to their home locations in
+// one burst too, and then the header block.
+
+// Block #s logged by a transaction, in memory.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[LOGMAX];
+};
+
+// The start of a transaction's descriptor; block #s
+// follow, packed BSIZE bytes to a block.
+struct logdesc {
+  uint magic;
+  uint seq;
+  uint n;
+  uint sum;
 };
 
+#define LOGMAGIC 0x6c6f6731
+#define DPB (BSIZE / sizeof(uint))  // descriptor words per block
+#define NDESC(n) ((sizeof(struct logdesc) + sizeof(uint)*(n) + BSIZE - 1) / BSIZE)
+
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // blocks after the header, at most LOGMAX
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks they may yet write.
+  int committing;  // closing lh or checkpointing, please wait.
+  int want;        // someone wants lh committed, or log space.
+  uint opened;     // ticks when lh got its first block.
+  uint lastcommit; // ticks when the last commit finished.
+  uint seq;        // lh's transaction number.
+  uint done;       // last transaction number safely in the log.
+  uint hseq;       // what the on-disk header says.
+  int used;        // log blocks taken by closed transactions.
   int dev;
-  struct logheader lh;
+  struct logheader lh;   // the open transaction.
+
+  // The logger's copy of the transaction it is committing,
+  // where in the log it goes, and the cache bufs it pinned.
+  struct logheader clh;
+  int cpos;
+  struct buf *shadow[LOGMAX];
+  struct buf *pinned[LOGMAX];
+  struct buf *desc[NDESC(LOGMAX)];
+  struct buf *batch[NDESC(LOGMAX) + LOGMAX];
+
+  // The distinct blocks in the log, each pinned once.
+  struct buf *live[LOGMAX];
+  int nlive;
+
+  // For reading the log back.
+  struct buf *rbuf;
+  struct logheader rlh;
+
+  int crashat;     // tear the next commit after this many blocks.
+  int crashok;     // and did recovery do the right thing?
 };
 struct log log;
 
-static void recover_from_log(void);
-static void commit();
+static struct kmem_cache shadowcache;
+
+static int scan_log(int);
+static void checkpoint(void);
+static void logger(void);
+
+static struct buf*
+logbuf(void)
+{
+  struct buf *b;
+
+  if ((b = kmem_cache_alloc(&shadowcache)) == 0)
+    panic("logbuf");
+  memset(b, 0, sizeof(struct buf));
+  initsleeplock(&b->lock, "shadow");
+  b->dev = log.dev;
+  return b;
+}
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  int i;
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
-  log.size = sb->nlog;
+  log.size = sb->nlog - 1;
+  if (log.size < LOGMIN)
+    panic("initlog: log too small");
+  if (log.size > LOGMAX)
+    log.size = LOGMAX;
+  if (writeimax(log_maxop()) < BSIZE)
+    panic("initlog: no room for a write");
   log.dev = dev;
-  recover_from_log();
+  log.crashat = -1;
+
+  kmem_cache_init(&shadowcache, "shadow", sizeof(struct buf));
+  for (i = 0; i < log.size; i++)
+    log.shadow[i] = logbuf();
+  for (i = 0; i < NDESC(LOGMAX); i++)
+    log.desc[i] = logbuf();
+  log.rbuf = logbuf();
+  // the log may pin this many blocks in the cache.
+  breserve(log.size);
+
+  // if committed, copy from log to cache, and
+  // then on to disk, and clear the log.
+  i = scan_log(1);
+  log.seq = log.hseq + i;
+  log.done = log.seq - 1;
+  checkpoint();
+  kthread(logger, "logger");
 }
 
-// Copy committed blocks from log to their home location
-static void
-install_trans(int recovering)
+// Read log block blockno into log.rbuf, which
+// the caller has locked, going around the cache.
+static uint*
+read_raw(int blockno)
 {
-  int tail;
+  log.rbuf->blockno = blockno;
+  bread_start(&log.rbuf, 1);
+  bwait(log.rbuf);
+  return (uint *) log.rbuf->data;
+}
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
-  }
+static uint
+cksum(uint h, void *p, int n)
+{
+  uint *w = p;
+
+  for (int i = 0; i < n / sizeof(uint); i++)
+    h = (h ^ w[i]) * 16777619;
+  return h;
 }
 
-// Read the log header from disk into the in-memory log header
-static void
-read_head(void)
+// The checksum of a transaction, less its blocks' contents.
+static uint
+desc_sum(uint seq, struct logheader *h)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  uint sum = 2166136261;
+
+  sum = cksum(sum, &seq, sizeof(seq));
+  sum = cksum(sum, &h->n, sizeof(h->n));
+  return cksum(sum, h->block, h->n * sizeof(h->block[0]));
+}
+
+// Read the descriptor of a transaction numbered seq at
+// log position pos into log.rlh. Returns its checksum, or
+// sets log.rlh.n to -1 if there's no such transaction.
+static uint
+read_desc(int pos, uint seq)
+{
+  struct logdesc *d;
+  uint *w, sum;
+  int i = 0, j, k;
+
+  log.rlh.n = -1;
+  w = read_raw(log.start + 1 + pos);
+  d = (struct logdesc *) w;
+  if (d->magic != LOGMAGIC || d->seq != seq || d->n == 0 ||
+     d->n > log.size || pos + NDESC(d->n) + d->n > log.size)
+    return 0;
+  log.rlh.n = d->n;
+  sum = d->sum;
+  j = sizeof(*d) / sizeof(uint);
+  for (k = 0; k < NDESC(log.rlh.n); k++) {
+    if (k > 0) {
+      w = read_raw(log.start + 1 + pos + k);
+      j = 0;
+    }
+    for (; j < DPB && i < log.rlh.n; j++)
+      log.rlh.block[i++] = w[j];
   }
-  brelse(buf);
+  return sum;
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void
-write_head(void)
+// Walk the on-disk log from the header, counting the
+// complete transactions; if apply, copy their blocks to
+// the cache and pin them there, for checkpoint() to
+// write to their home locations.
+static int
+scan_log(int apply)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  int pos = 0, ntrans = 0, i;
+  uint seq, sum, have;
+  struct buf *dbuf;
+  uint *w;
+
+  acquiresleep(&log.rbuf->lock);
+  if (apply) {
+    w = read_raw(log.start);
+    log.hseq = w[0] == LOGMAGIC ? w[1] : 1;
   }
-  bwrite(buf);
-  brelse(buf);
+  seq = log.hseq;
+
+  while (pos < log.size) {
+    sum = read_desc(pos, seq);
+    if (log.rlh.n < 0)
+      break;
+    have = desc_sum(seq, &log.rlh);
+    for (i = 0; i < log.rlh.n; i++)
+      have = cksum(have, read_raw(log.start + 1 + pos + NDESC(log.rlh.n) + i), BSIZE);
+    if (have != sum)
+      break;   // torn
+
+    for (i = 0; apply && i < log.rlh.n; i++) {
+      w = read_raw(log.start + 1 + pos + NDESC(log.rlh.n) + i);
+      dbuf = bread(log.dev, log.rlh.block[i]); // read dst
+      memmove(dbuf->data, w, BSIZE);  // copy block to dst
+      if (!dbuf->inlog) {
+        dbuf->inlog = 1;
+        bpin(dbuf);
+        log.live[log.nlive++] = dbuf;
+      }
+      brelse(dbuf);
+    }
+    pos += NDESC(log.rlh.n) + log.rlh.n;
+    seq++;
+    ntrans++;
+  }
+  releasesleep(&log.rbuf->lock);
+  return ntrans;
 }
 
+// Write the header block, saying that the log is
+// empty and the next transaction is log.seq.
 static void
-recover_from_log(void)
+write_head(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  uint *w;
+
+  acquiresleep(&log.rbuf->lock);
+  w = (uint *) log.rbuf->data;
+  memset(w, 0, BSIZE);
+  w[0] = LOGMAGIC;
+  w[1] = log.seq;
+  log.rbuf->blockno = log.start;
+  bwrite(log.rbuf);
+  releasesleep(&log.rbuf->lock);
+  log.hseq = log.seq;
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call
+// that may write up to n blocks.
 void
-begin_op(void)
+begin_opn(int n)
 {
+  if (n > log_maxop())
+    panic("begin_opn");
+
   acquire(&log.lock);
   while(1){
+    int m = log.lh.n + log.reserved + n;
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.used + NDESC(m) + m > log.size){
+      // this op might exhaust log space; wait for
+      // a commit or a checkpoint.
+      log.want = 1;
+      wakeup(&log.want);
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
       release(&log.lock);
       break;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
 void
-end_op(void)
+begin_op(void)
 {
-  int do_commit = 0;
+  begin_opn(MAXOPBLOCKS);
+}
 
+// called at the end of each FS system call,
+// with what it passed to begin_opn().
+void
+end_opn(int n)
+{
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+  log.reserved -= n;
+  // begin_op() may be waiting for log space, and
+  // decrementing log.reserved has decreased the
+  // amount of reserved space; or the logger may be
+  // waiting for the last outstanding operation.
+  wakeup(&log);
+  release(&log.lock);
+}
+
+void
+end_op(void)
+{
+  end_opn(MAXOPBLOCKS);
+}
+
+// The most blocks one system call may reserve: after a
+// commit the log is at most half full, so there's always
+// room for one of these, and usually for several.
+int
+log_maxop(void)
+{
+  return log.size / 4;
+}
+
+// Wait until every FS system call that has
+// finished is safely in the on-disk log.
+void
+log_sync(void)
+{
+  uint target;
+
+  acquire(&log.lock);
+  if(log.lh.n > 0){
+    target = log.seq;
+    log.want = 1;
+    wakeup(&log.want);
   } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+    target = log.seq - 1;  // perhaps still being committed
   }
+  while((int)(log.done - target) < 0)
+    sleep(&log.done, &log.lock);
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
-  }
+// Is there work for the logger? Caller holds log.lock,
+// or is the timer interrupt taking a peek.
+static int
+logdue(void)
+{
+  if(log.lh.n > 0)
+    return log.want || ticks - log.opened >= COMMITTICKS;
+  return log.used > 0 && (log.want || ticks - log.lastcommit >= CKPTTICKS);
 }
 
-// Copy modified blocks from cache to log.
+// Called by the timer interrupt on every tick: wake the
+// logger if a commit or checkpoint is due.
+void
+logtick(void)
+{
+  if(logdue())
+    wakeup(&log.want);
+}
+
+// Close the open transaction: hold up new system calls, wait
+// for the ones in it to finish, and copy its blocks to the
+// shadow bufs. Leaves log.committing set.
 static void
-write_log(void)
+close_trans(void)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
+  acquire(&log.lock);
+  log.committing = 1;
+  while(log.outstanding > 0)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+
+  // no one can log_write() now.
+  log.clh = log.lh;
+  for (tail = 0; tail < log.clh.n; tail++) {
+    struct buf *from = bread(log.dev, log.clh.block[tail]); // cache block
+    struct buf *to = log.shadow[tail];
+    acquiresleep(&to->lock);
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    log.pinned[tail] = from;
     brelse(from);
-    brelse(to);
   }
+
+  acquire(&log.lock);
+  log.lh.n = 0;
+  log.cpos = log.used;
+  if(log.clh.n > 0){
+    log.used += NDESC(log.clh.n) + log.clh.n;
+    log.seq++;
+  }
+  release(&log.lock);
+}
+
+// Let new system calls begin again.
+static void
+open_trans(void)
+{
+  acquire(&log.lock);
+  log.committing = 0;
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// Start writing bufs[0..n-1] of a commit, and wait for them.
+static void
+write_wait(struct buf **bufs, int n)
+{
+  bwrite_start(bufs, n);
+  for (int i = 0; i < n; i++)
+    bwait(bufs[i]);
+}
+
+// Append the closed transaction, numbered seq, to the
+// on-disk log: its descriptor and its blocks, in one burst.
+// This is the true point at which the transaction commits.
+static void
+write_log(uint seq)
+{
+  struct buf **bufs = log.batch;
+  struct logdesc *d;
+  struct buf *b;
+  int nd = NDESC(log.clh.n), n = 0, i, j, k, tear;
+  uint *w;
+
+  for (k = 0, i = 0; k < nd; k++) {
+    b = bufs[n++] = log.desc[k];
+    acquiresleep(&b->lock);
+    b->blockno = log.start + 1 + log.cpos + k;
+    memset(b->data, 0, BSIZE);
+    w = (uint *) b->data;
+    j = 0;
+    if (k == 0) {
+      d = (struct logdesc *) w;
+      d->magic = LOGMAGIC;
+      d->seq = seq;
+      d->n = log.clh.n;
+      d->sum = desc_sum(seq, &log.clh);
+      j = sizeof(*d) / sizeof(uint);
+    }
+    for (; j < DPB && i < log.clh.n; j++)
+      w[j] = log.clh.block[i++];
+  }
+  d = (struct logdesc *) log.desc[0]->data;
+  for (i = 0; i < log.clh.n; i++) {
+    b = bufs[n++] = log.shadow[i];
+    b->dev = log.dev;
+    b->blockno = log.start + 1 + log.cpos + nd + i;
+    d->sum = cksum(d->sum, b->data, BSIZE);
+  }
+
+  acquire(&log.lock);
+  tear = log.crashat;
+  release(&log.lock);
+  if (tear >= 0 && tear < n) {
+    // pretend to crash after the first tear blocks reach
+    // the disk: would recovery replay every transaction
+    // before this one, and not this one?
+    write_wait(bufs, tear);
+    log.crashok = scan_log(0) == (int)(seq - log.hseq);
+    write_wait(bufs + tear, n - tear);
+  } else {
+    write_wait(bufs, n);
+    if (tear >= 0)
+      log.crashok = scan_log(0) == (int)(seq - log.hseq) + 1;
+  }
+  for (i = 0; i < n; i++)
+    releasesleep(&bufs[i]->lock);
+  if (tear >= 0) {
+    acquire(&log.lock);
+    log.crashat = -1;
+    wakeup(&log.crashat);
+    release(&log.lock);
+  }
+
+  // each logged block stays pinned once until checkpointed.
+  for (i = 0; i < log.clh.n; i++) {
+    b = log.pinned[i];
+    if (b->inlog) {
+      bunpin(b);
+    } else {
+      b->inlog = 1;
+      log.live[log.nlive++] = b;
+    }
+  }
+}
+
+// Install every logged block at its home location, and
+// empty the log. Caller has closed the open transaction
+// and committed it, so the cache holds what the log says.
+// System calls are held up, so no one can modify the
+// blocks while they're written, and they're pinned, so
+// they needn't be locked; readers only wait for the
+// block they want.
+static void
+checkpoint(void)
+{
+  int i;
+
+  bwrite_pinned(log.live, log.nlive);
+  for (i = 0; i < log.nlive; i++) {
+    bwait(log.live[i]);
+    log.live[i]->inlog = 0;
+    bunpin(log.live[i]);
+  }
+  log.nlive = 0;
+  write_head();    // Erase the transactions from the log
+
+  acquire(&log.lock);
+  log.used = 0;
+  release(&log.lock);
 }
 
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  int ckpt;
+
+  close_trans();
+
+  // checkpoint if this leaves the log more than half full,
+  // or if there's nothing to commit and someone wants space
+  // or the log has been idle.
+  ckpt = log.clh.n == 0 || log.used > log.size/2;
+  if(!ckpt)
+    open_trans();
+
+  if(log.clh.n > 0){
+    write_log(log.seq - 1);  // the transaction close_trans() closed
+    acquire(&log.lock);
+    log.done = log.seq - 1;
+    wakeup(&log.done);
+    release(&log.lock);
+  }
+
+  if(ckpt){
+    checkpoint();
+    open_trans();
+  }
+
+  acquire(&log.lock);
+  log.lastcommit = ticks;
+  release(&log.lock);
+}
+
+// The logger kernel thread: commit the open transaction,
+// or checkpoint the log, whenever it is due.
+static void
+logger(void)
+{
+  acquire(&log.lock);
+  for(;;){
+    while(!logdue())
+      sleep(&log.want, &log.lock);
+    log.want = 0;
+    release(&log.lock);
+    commit();
+    acquire(&log.lock);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// The logger will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -214,23 +624,46 @@ commit()
 void
 log_write(struct buf *b)
 {
-  int i;
-
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.used + NDESC(log.lh.n + 1) + log.lh.n + 1 > log.size)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorption
-      break;
-  }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  // log absorption: b stays pinned, and so holds the
+  // same block, while the transaction it was logged in
+  // is open, so b itself remembers whether it's in lh.
+  if (b->logseq != log.seq) {  // Add new block to log?
+    b->logseq = log.seq;
     bpin(b);
-    log.lh.n++;
+    if (log.lh.n == 0)
+      log.opened = ticks;
+    log.lh.block[log.lh.n++] = b->blockno;
   }
   release(&log.lock);
 }
 
+// For testing recovery: make the next commit of the open
+// transaction write only its first n blocks to the log, see
+// what recovery would make of the log, and then finish.
+// Returns 0 if recovery would replay exactly the complete
+// transactions, -1 if not, or 1 if no transaction is open.
+int
+log_crash(int n)
+{
+  int ok;
+
+  acquire(&log.lock);
+  if(log.lh.n == 0 || log.crashat >= 0){
+    release(&log.lock);
+    return 1;
+  }
+  log.crashat = n < 0 ? 0 : n;
+  log.want = 1;
+  wakeup(&log.want);
+  while(log.crashat >= 0)
+    sleep(&log.crashat, &log.lock);
+  ok = log.crashok;
+  release(&log.lock);
+  return ok ? 0 : -1;
+}
@@ -17,7 +17,9 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    slabinit();      // small-object allocator
     kvminit();       // create kernel page table
+    vmainit();       // shared program text
     kvminithart();   // turn on paging
     procinit();      // process table
     trapinit();      // trap vectors
@@ -25,8 +27,11 @@ main()
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    blkq_init();     // disk request queue
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    statsinit();     // statistics device
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
@@ -47,6 +47,11 @@
 #define KERNBASE 0x80000000L
 #define PHYSTOP (KERNBASE + 128*1024*1024)
 
+// the kernel reaches the current process's user memory at
+// UALIAS(va), in the upper half of the Sv39 address space,
+// which xv6 doesn't otherwise use (see ualias() in vm.c).
+#define UALIAS(va) ((uint64)(va) | 0xFFFFFFC000000000L)
+
 // map the trampoline page to the highest address,
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
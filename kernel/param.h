@@ -1,13 +1,21 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // unused in-memory i-nodes kept cached
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define LOGSIZE      200   // mkfs's default on-disk log size, in blocks
+#define LOGMAX       1024  // most data blocks the kernel will log
+#define COMMITTICKS  5     // ticks a log transaction may stay open
+#define CKPTTICKS    20    // ticks an idle log waits to be checkpointed
+#define NBUF         (MAXOPBLOCKS*3)  // least size of disk block cache, besides the log's
+#define BCACHEFRAC   8     // disk block cache grows to 1/BCACHEFRAC of RAM
+#define READAHEAD    32    // most blocks read ahead of a sequential reader
+#define FSSIZE       8000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define MAXORDER     10    // largest physical allocation is PGSIZE<<MAXORDER bytes
+#define LAZYSBRK     1     // 1: sbrk() allocates on first touch; 0: eagerly
+#define NVMA         16    // file-backed memory regions per process
+#define NTEXT        512   // read-only program pages cached for sharing
@@ -7,6 +7,7 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "slab.h"
 
 #define PIPESIZE 512
 
@@ -19,6 +20,14 @@ struct pipe {
   int writeopen;  // write fd is still open
 };
 
+struct kmem_cache pipecache;
+
+void
+pipeinit(void)
+{
+  kmem_cache_init(&pipecache, "pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,7 +37,7 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = (struct pipe*)kmem_cache_alloc(&pipecache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
@@ -47,7 +56,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmem_cache_free(&pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,7 +77,7 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kmem_cache_free(&pipecache, pi);
   } else
     release(&pi->lock);
 }
@@ -78,6 +87,13 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
 {
   int i = 0;
   struct proc *pr = myproc();
+  char ch;
+
+  // fault in the source pages before taking the lock:
+  // demand-paged program text and mapped files have to be
+  // read from their files, which can't be done while
+  // holding a spinlock.
+  vmaprefault(addr, n);
 
   acquire(&pi->lock);
   while(i < n){
@@ -89,7 +105,6 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     } else {
-      char ch;
       if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
         break;
       pi->data[pi->nwrite++ % PIPESIZE] = ch;
@@ -109,6 +124,8 @@ piperead(struct pipe *pi, uint64 addr, int n)
   struct proc *pr = myproc();
   char ch;
 
+  vmaprefault(addr, n);  // as in pipewrite()
+
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
     if(killed(pr)){
@@ -120,9 +137,10 @@ piperead(struct pipe *pi, uint64 addr, int n)
   for(i = 0; i < n; i++){  //DOC: piperead-copy
     if(pi->nread == pi->nwrite)
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
+    ch = pi->data[pi->nread % PIPESIZE];
     if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
       break;
+    pi->nread++;
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
@@ -132,6 +132,13 @@ found:
     return 0;
   }
 
+  // A kernel page table that can reach the user memory.
+  if((p->kpagetable = kvmcreate()) == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+
   // An empty user page table.
   p->pagetable = proc_pagetable(p);
   if(p->pagetable == 0){
@@ -158,10 +165,15 @@ freeproc(struct proc *p)
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
+  if(p->kpagetable)
+    kfree((void*)p->kpagetable);
+  p->kpagetable = 0;
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   p->sz = 0;
+  p->stackguard = 0;
+  p->bigheap = p->bigheapend = 0;
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
@@ -263,12 +275,29 @@ growproc(int n)
   struct proc *p = myproc();
 
   sz = p->sz;
-  if(n > 0){
+  if(n > 0 && LAZYSBRK){
+    // just claim the address space; usertrap() allocates
+    // each page when it is first touched.
+    if(sz + n > vmalimit(p))
+      return -1;
+    if(n >= PGSIZE2M){
+      // a big heap: worth superpages, if it's used.
+      if(p->bigheapend != sz)
+        p->bigheap = sz;
+      p->bigheapend = sz + n;
+    }
+    sz += n;
+  } else if(n > 0){
+    if(sz + n > vmalimit(p))
+      return -1;
     if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
       return -1;
     }
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    if((sz = uvmdealloc(p->pagetable, sz, sz + n)) == p->sz)
+      return -1;
+    if(p->bigheapend > sz)
+      p->bigheapend = sz;
   }
   p->sz = sz;
   return 0;
@@ -295,6 +324,14 @@ fork(void)
     return -1;
   }
   np->sz = p->sz;
+  np->stackguard = p->stackguard;
+  np->bigheap = p->bigheap;
+  np->bigheapend = p->bigheapend;
+  if(vmadup(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -360,6 +397,9 @@ exit(int status)
     }
   }
 
+  // write back and release mapped files.
+  vmaunmap(p, 0, MAXVA);
+
   begin_op();
   iput(p->cwd);
   end_op();
@@ -394,6 +434,10 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the status is copied out holding spinlocks.
+  if(addr != 0)
+    vmaprefault(addr, sizeof(int));
+
   acquire(&wait_lock);
 
   for(;;){
@@ -446,12 +490,14 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int found;
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
+    found = 0;
     for(p = proc; p < &proc[NPROC]; p++) {
       acquire(&p->lock);
       if(p->state == RUNNABLE) {
@@ -460,14 +506,23 @@ scheduler(void)
         // before jumping back to us.
         p->state = RUNNING;
         c->proc = p;
+        w_satp(MAKE_SATP(p->kpagetable));
+        sfence_vma();
         swtch(&c->context, &p->context);
 
         // Process is done running for now.
         // It should have changed its p->state before coming back.
+        // Its kernel page table may be freed once it's UNUSED.
+        kvminithart();
         c->proc = 0;
+        found = 1;
       }
       release(&p->lock);
     }
+
+    // nothing to run; use the time to pre-zero pages.
+    if(found == 0)
+      kzero_refill();
   }
 }
 
@@ -530,6 +585,35 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by
+// scheduler() will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  myproc()->kfn();
+  panic("kthread returned");
+}
+
+// Start a process that runs fn() in the kernel,
+// and never returns to user space. fn must not
+// return either.
+void
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
@@ -79,6 +79,19 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A region of user memory filled in on demand from a file,
+// or with zeros: a program segment or an mmap() (vma.c).
+struct vma {
+  uint64 start;                // page-aligned first address
+  uint64 end;                  // page-aligned end; 0 if slot is unused
+  int perm;                    // PTE_R/W/X/U of the region's pages
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct inode *ip;            // backing file, or 0 for anonymous memory
+  uint off;                    // file offset of start
+  uint filesz;                 // bytes of file from start; the rest is zero
+  int text;                    // an exec() segment, counted in ip->ntext
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -98,10 +111,16 @@ struct proc {
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
+  uint64 stackguard;           // User stack guard page (no PTE_U)
+  uint64 bigheap;              // [bigheap, bigheapend) came from big sbrk()s:
+  uint64 bigheapend;           //   vmafault() may use superpages there
   pagetable_t pagetable;       // User page table
+  pagetable_t kpagetable;      // Kernel page table, aliasing user memory
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // File-backed regions of memory
   char name[16];               // Process name (debugging)
+  void (*kfn)(void);           // Body of a kernel thread
 };
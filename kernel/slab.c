@@ -0,0 +1,284 @@
+// Slab allocator for small kernel objects.
+//
+// A kmem_cache hands out objects of one fixed size. It carves
+// pages from kalloc() into slabs: a struct slab header at the
+// start of the page, followed by as many objects as fit. The
+// free objects of a slab are chained through their first word,
+// and the slab holding any object is found by rounding the
+// object's address down to a page boundary.
+//
+// Each hart keeps one magazine per cache, a small stack of free
+// objects, guarded by a lock that only slabreclaim() ever
+// contends. Only when its magazine runs empty or full does a
+// hart take the cache's lock, to move MAGSIZE/2 objects between
+// the magazine and the slabs.
+//
+// kmalloc()/kmfree() layer power-of-two size classes on top, for
+// objects that don't deserve a cache of their own.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "slab.h"
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;  // on cache->partial
+  struct slab *prev;
+  void *free;         // chain of free objects
+  int inuse;          // objects not on the free chain
+};
+
+#define SLABHDR  ((sizeof(struct slab) + 15) & ~15)
+
+#define KMALLOC_MIN   16
+#define KMALLOC_MAX   1024
+#define NKMALLOC      7   // size classes 16, 32, ..., KMALLOC_MAX
+
+static struct {
+  struct spinlock lock;
+  struct kmem_cache *caches;  // all caches, for statistics
+} slabs;
+
+static struct kmem_cache kmalloc_caches[NKMALLOC];
+static char *kmalloc_names[NKMALLOC] = {
+  "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+  "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+
+void
+slabinit(void)
+{
+  initlock(&slabs.lock, "slabs");
+  for(int i = 0; i < NKMALLOC; i++)
+    kmem_cache_init(&kmalloc_caches[i], kmalloc_names[i], KMALLOC_MIN << i);
+}
+
+// Initialize cache c to hand out objects of size bytes.
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint size)
+{
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = (size + 7) & ~7;
+  if(c->size < sizeof(void*) || c->size > PGSIZE - SLABHDR)
+    panic("kmem_cache_init: size");
+  c->perslab = (PGSIZE - SLABHDR) / c->size;
+  c->partial = 0;
+  c->nslab = 0;
+  c->ninuse = 0;
+  for(int i = 0; i < NCPU; i++){
+    initlock(&c->mag[i].lock, "magazine");
+    c->mag[i].n = 0;
+  }
+
+  acquire(&slabs.lock);
+  c->next = slabs.caches;
+  slabs.caches = c;
+  release(&slabs.lock);
+}
+
+static void
+partial_remove(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+  s->next = s->prev = 0;
+}
+
+static void
+partial_push(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+// Carve a fresh page into a slab for c.
+// Caller holds c->lock.
+static struct slab*
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *p;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->inuse = 0;
+  s->free = 0;
+  for(p = (char*)s + SLABHDR + (c->perslab-1)*c->size; p >= (char*)s + SLABHDR; p -= c->size){
+    *(void**)p = s->free;
+    s->free = p;
+  }
+  partial_push(c, s);
+  c->nslab++;
+  return s;
+}
+
+// Fill magazine m half full from c's slabs.
+// Caller holds c->lock.
+static void
+mag_refill(struct kmem_cache *c, struct magazine *m)
+{
+  struct slab *s;
+  void *obj;
+
+  while(m->n < MAGSIZE/2){
+    if((s = c->partial) == 0 && (s = slab_grow(c)) == 0)
+      break;
+    obj = s->free;
+    s->free = *(void**)obj;
+    s->inuse++;
+    c->ninuse++;
+    if(s->free == 0)
+      partial_remove(c, s);
+    m->obj[m->n++] = obj;
+  }
+}
+
+// Return obj to its slab, and the slab's page to
+// kalloc() if it is empty and not the only partial slab
+// (or if all is set).
+// Caller holds c->lock.
+static void
+slab_put(struct kmem_cache *c, void *obj, int all)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+
+  if(s->cache != c)
+    panic("kmem_cache_free: wrong cache");
+  if(s->free == 0)
+    partial_push(c, s);
+  *(void**)obj = s->free;
+  s->free = obj;
+  s->inuse--;
+  c->ninuse--;
+  if(s->inuse == 0 && (all || s->prev || s->next)){
+    partial_remove(c, s);
+    c->nslab--;
+    kfree(s);
+  }
+}
+
+// Allocate an object from cache c.
+// Returns 0 if out of memory.
+// The object's contents are undefined.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj = 0;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n == 0){
+    acquire(&c->lock);
+    mag_refill(c, m);
+    release(&c->lock);
+  }
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  release(&m->lock);
+  pop_off();
+  return obj;
+}
+
+// Return obj, which came from kmem_cache_alloc(c), to c.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      slab_put(c, m->obj[--m->n], 0);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = obj;
+  release(&m->lock);
+  pop_off();
+}
+
+// Allocate n bytes from the smallest size class that fits.
+// Returns 0 if out of memory.
+void*
+kmalloc(uint n)
+{
+  int i;
+
+  for(i = 0; i < NKMALLOC; i++)
+    if(n <= (KMALLOC_MIN << i))
+      return kmem_cache_alloc(&kmalloc_caches[i]);
+  panic("kmalloc: too big");
+}
+
+// Free memory returned by kmalloc().
+void
+kmfree(void *p)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)p);
+
+  kmem_cache_free(s->cache, p);
+}
+
+// Empty every magazine back into its slabs and give all
+// wholly free slabs back to kalloc(). Called by kalloc()
+// when memory runs out. The caller must hold no spinlocks.
+// Returns the number of pages freed.
+int
+slabreclaim(void)
+{
+  struct kmem_cache *c;
+  struct magazine *m;
+  int nslab, freed = 0;
+
+  acquire(&slabs.lock);
+  for(c = slabs.caches; c; c = c->next){
+    nslab = c->nslab;
+    for(m = c->mag; m < &c->mag[NCPU]; m++){
+      acquire(&m->lock);
+      acquire(&c->lock);
+      while(m->n > 0)
+        slab_put(c, m->obj[--m->n], 1);
+      release(&c->lock);
+      release(&m->lock);
+    }
+    freed += nslab - c->nslab;
+  }
+  release(&slabs.lock);
+  return freed;
+}
+
+// Report each cache's object and slab counts
+// for the statistics device.
+int
+slabstats(char *buf, int sz)
+{
+  struct kmem_cache *c;
+  int n = 0;
+
+  n += snprintf(buf+n, sz-n, "--- slab: name size inuse slabs\n");
+  acquire(&slabs.lock);
+  for(c = slabs.caches; c; c = c->next){
+    if(c->nslab == 0)
+      continue;
+    n += snprintf(buf+n, sz-n, "%s %d %d %d\n",
+                  c->name, c->size, c->ninuse, c->nslab);
+  }
+  release(&slabs.lock);
+  return n;
+}
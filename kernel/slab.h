@@ -0,0 +1,23 @@
+// Object caches for small kernel structures.
+// See slab.c.
+
+#define MAGSIZE 16  // objects per per-hart magazine
+
+// a hart's private stack of free objects.
+struct magazine {
+  struct spinlock lock;   // only contended by slabreclaim()
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  struct spinlock lock;   // protects the slab lists and counters
+  char *name;
+  uint size;              // bytes per object
+  uint perslab;           // objects per slab page
+  struct slab *partial;   // slabs with at least one free object
+  int nslab;              // slab pages in use
+  int ninuse;             // objects handed out of slabs
+  struct kmem_cache *next; // list of all caches
+  struct magazine mag[NCPU]; // indexed by cpuid()
+};
@@ -0,0 +1,113 @@
+//
+// formatted output into a kernel buffer,
+// for the statistics device.
+//
+
+#include <stdarg.h>
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+static char digits[] = "0123456789abcdef";
+
+static int
+sputc(char *s, int sz, int off, char c)
+{
+  if(off < sz)
+    s[off] = c;
+  return 1;
+}
+
+static int
+sprintint(char *s, int sz, int off, long xx, int base, int sign)
+{
+  char buf[24];
+  int i, n;
+  uint64 x;
+
+  if(sign && (sign = xx < 0))
+    x = -xx;
+  else
+    x = xx;
+
+  i = 0;
+  do {
+    buf[i++] = digits[x % base];
+  } while((x /= base) != 0);
+
+  if(sign)
+    buf[i++] = '-';
+
+  n = 0;
+  while(--i >= 0)
+    n += sputc(s, sz, off+n, buf[i]);
+  return n;
+}
+
+// Print to buf, never writing more than sz bytes.
+// Understands %d, %x, %ld, %lx, %s.
+// Returns the number of bytes written.
+int
+snprintf(char *buf, int sz, char *fmt, ...)
+{
+  va_list ap;
+  int i, c;
+  int off = 0;
+  char *s;
+
+  if(fmt == 0)
+    panic("null fmt");
+  if(sz <= 0)
+    return 0;
+
+  va_start(ap, fmt);
+  for(i = 0; off < sz && (c = fmt[i] & 0xff) != 0; i++){
+    if(c != '%'){
+      off += sputc(buf, sz, off, c);
+      continue;
+    }
+    c = fmt[++i] & 0xff;
+    if(c == 0)
+      break;
+    if(c == 'l'){
+      c = fmt[++i] & 0xff;
+      if(c == 'd')
+        off += sprintint(buf, sz, off, va_arg(ap, long), 10, 1);
+      else if(c == 'x')
+        off += sprintint(buf, sz, off, va_arg(ap, long), 16, 0);
+      else
+        break;
+      continue;
+    }
+    switch(c){
+    case 'd':
+      off += sprintint(buf, sz, off, va_arg(ap, int), 10, 1);
+      break;
+    case 'x':
+      off += sprintint(buf, sz, off, va_arg(ap, uint), 16, 0);
+      break;
+    case 's':
+      if((s = va_arg(ap, char*)) == 0)
+        s = "(null)";
+      for(; *s && off < sz; s++)
+        off += sputc(buf, sz, off, *s);
+      break;
+    case '%':
+      off += sputc(buf, sz, off, '%');
+      break;
+    default:
+      // Print unknown % sequence to draw attention.
+      off += sputc(buf, sz, off, '%');
+      off += sputc(buf, sz, off, c);
+      break;
+    }
+  }
+  va_end(ap);
+  return off < sz ? off : sz;
+}
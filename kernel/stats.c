@@ -0,0 +1,87 @@
+//
+// the statistics device: reading it returns a text
+// report of kernel counters (lock contention,
+// allocator state, &c), one subsystem after another.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define BUFSZ 4096
+
+static struct {
+  struct spinlock lock;
+  char buf[BUFSZ];
+  int sz;
+  int off;
+} stats;
+
+int
+statswrite(int user_src, uint64 src, int n)
+{
+  return -1;
+}
+
+// Fill stats.buf with a fresh snapshot of every
+// subsystem's counters.
+static int
+statsfill(char *buf, int sz)
+{
+  int n = 0;
+
+  n += kallocstats(buf+n, sz-n);
+  n += bcachestats(buf+n, sz-n);
+  n += fsstats(buf+n, sz-n);
+  n += blkqstats(buf+n, sz-n);
+  n += slabstats(buf+n, sz-n);
+  n += textstats(buf+n, sz-n);
+  return n;
+}
+
+// Return the next chunk of the report. A read at the end of
+// the report returns 0 and rewinds, so that the next
+// read takes a fresh snapshot.
+int
+statsread(int user_dst, uint64 dst, int n)
+{
+  int m;
+
+  // as in consoleread().
+  if(user_dst)
+    vmaprefault(dst, n);
+  acquire(&stats.lock);
+
+  if(stats.sz == 0)
+    stats.sz = statsfill(stats.buf, BUFSZ);
+  m = stats.sz - stats.off;
+
+  if(m > 0){
+    if(m > n)
+      m = n;
+    if(either_copyout(user_dst, dst, stats.buf+stats.off, m) != -1)
+      stats.off += m;
+    else
+      m = -1;
+  } else {
+    m = 0;
+    stats.sz = 0;
+    stats.off = 0;
+  }
+  release(&stats.lock);
+  return m;
+}
+
+void
+statsinit(void)
+{
+  initlock(&stats.lock, "stats");
+
+  devsw[STATS].read = statsread;
+  devsw[STATS].write = statswrite;
+}
@@ -262,7 +262,7 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0){
+  if((ip = ialloc(dp->dev, type, dp->inum)) == 0){
     iunlockput(dp);
     return 0;
   }
@@ -341,6 +341,13 @@ sys_open(void)
     return -1;
   }
 
+  // a running program's text can't change under it.
+  if((omode & (O_WRONLY|O_RDWR|O_TRUNC)) && ip->ntext > 0){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
@@ -503,3 +510,55 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// void *mmap(void *addr, uint len, int prot, int flags, int fd, uint off)
+// addr is only a hint, and is ignored.
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len;
+  int prot, flags, off;
+  struct file *f = 0;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  if((flags & MAP_ANONYMOUS) == 0 && argfd(4, 0, &f) < 0)
+    return -1;
+  return vmamap(myproc(), len, prot, flags, f, off);
+}
+
+// Return once everything written to fd's file (indeed,
+// every file system update made so far) is safely on disk.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  log_sync();
+  return 0;
+}
+
+// Tear the next commit after n blocks, to test recovery.
+uint64
+sys_logcrash(void)
+{
+  int n;
+
+  argint(0, &n);
+  return log_crash(n);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return vmaunmap(myproc(), addr, len);
+}
@@ -10,6 +10,7 @@ struct spinlock tickslock;
 uint ticks;
 
 extern char trampoline[], uservec[], userret[];
+extern char ucopy_start[], ucopy_end[], ucopy_fault[];
 
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
@@ -67,6 +68,10 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if((r_scause() == 13 || r_scause() == 15) &&
+            vmafault(p, r_stval(), r_scause() == 15) == 0){
+    // page fault on a demand-paged, lazily-allocated or
+    // copy-on-write page, which is now mapped.
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -144,15 +149,24 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  if((scause == 5 || scause == 7 || scause == 13 || scause == 15) &&
+     sepc >= (uint64)ucopy_start && sepc < (uint64)ucopy_end){
+    // a fault in ucopy() or ucopystr(): make it return -1.
+    sepc = (uint64)ucopy_fault;
+  } else if((which_dev = devintr()) == 0){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
   }
 
   // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  // sstatus belongs to the hart, and swtch() doesn't save
+  // it, so don't pass an interrupted ucopy()'s SUM on to
+  // whatever runs next; the w_sstatus() below gives it back.
+  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING){
+    w_sstatus(r_sstatus() & ~SSTATUS_SUM);
     yield();
+  }
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -166,6 +180,7 @@ clockintr()
   acquire(&tickslock);
   ticks++;
   wakeup(&ticks);
+  logtick();
   release(&tickslock);
 }
 
@@ -47,7 +47,10 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+#define NUM 64
+
+// the most data descriptors (blocks) in one disk request.
+#define MAXSEG 16
 
 // a single descriptor, from the spec.
 struct virtq_desc {
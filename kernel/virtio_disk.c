@@ -41,15 +41,18 @@ static struct disk {
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
+  uint16 kick_idx; // the device has been told about avail[..kick_idx].
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
     char status;
   } info[NUM];
 
+  // the buf whose data each data descriptor points to.
+  struct buf *bufs[NUM];
+
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
@@ -178,7 +181,6 @@ free_desc(int i)
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
 }
 
 // free a chain of descriptors.
@@ -196,12 +198,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +213,47 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// tell the device about requests submitted since it was
+// last told. caller holds vdisk_lock.
+static void
+kick(void)
+{
+  if(disk.kick_idx == disk.avail->idx)
+    return;
+  __sync_synchronize();
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  disk.kick_idx = disk.avail->idx;
+}
+
+// queue a request to read or write the m adjacent blocks in
+// bufs[], without telling the device yet, so that a caller
+// can queue several and have the device start on them all
+// at once. returns -1 if there aren't enough free descriptors
+// (the request queue in blkq.c waits for some to complete).
+// the caller holds each buf's lock and must virtio_disk_wait()
+// for each before releasing it.
+int
+virtio_disk_submit(struct buf **bufs, int m, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint64 sector = bufs[0]->blockno * (BSIZE / 512);
+  int idx[MAXSEG+2];
+  int k;
+
+  if(m < 1 || m > MAXSEG)
+    panic("virtio_disk_submit");
 
   acquire(&disk.vdisk_lock);
 
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // the spec's Section 5.2 says that block operations use a
+  // descriptor for type/reserved/sector, then descriptors for
+  // the data, then one for a 1-byte status result.
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+  if(alloc_descs(idx, m+2) < 0){
+    release(&disk.vdisk_lock);
+    return -1;
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,51 +270,73 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(k = 0; k < m; k++){
+    struct buf *b = bufs[k];
+    if(b->blockno != bufs[0]->blockno + k || b->dev != bufs[0]->dev)
+      panic("virtio_disk_submit: not adjacent");
+    disk.desc[idx[1+k]].addr = (uint64) b->data;
+    disk.desc[idx[1+k]].len = BSIZE;
+    if(write)
+      disk.desc[idx[1+k]].flags = 0; // device reads b->data
+    else
+      disk.desc[idx[1+k]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[1+k]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[1+k]].next = idx[2+k];
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+    // record struct buf for virtio_disk_intr().
+    b->disk = 1;
+    disk.bufs[idx[1+k]] = b;
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.info[idx[0]].status = 0xff; // device writes 0 on success
+  disk.desc[idx[m+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[m+1]].len = 1;
+  disk.desc[idx[m+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[m+1]].next = 0;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
 
   __sync_synchronize();
 
-  // tell the device another avail ring entry is available.
+  // another avail ring entry is available; kick() will
+  // tell the device.
   disk.avail->idx += 1; // not % NUM ...
 
-  __sync_synchronize();
+  release(&disk.vdisk_lock);
+  return 0;
+}
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+void
+virtio_disk_kick(void)
+{
+  acquire(&disk.vdisk_lock);
+  kick();
+  release(&disk.vdisk_lock);
+}
+
+// wait for the device to finish with b, which
+// was queued by virtio_disk_submit().
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+
+  kick();
 
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
 void
 virtio_disk_intr()
 {
+  int ndone = 0;
+
   acquire(&disk.vdisk_lock);
 
   // the device won't raise another interrupt until we tell it
@@ -316,12 +359,23 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    // the data descriptors are the ones
+    // between the header and the status.
+    for(int d = disk.desc[id].next; disk.desc[d].flags & VRING_DESC_F_NEXT; d = disk.desc[d].next){
+      struct buf *b = disk.bufs[d];
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
+      disk.bufs[d] = 0;
+      ndone++;
+    }
+
+    free_chain(id);
 
     disk.used_idx += 1;
   }
 
   release(&disk.vdisk_lock);
+
+  // there may be room now for requests waiting in blkq.c.
+  blkq_done(ndone);
 }
@@ -5,6 +5,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -15,6 +17,9 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+extern int ucopy(void*, void*, uint64);     // ucopy.S
+extern int ucopystr(char*, char*, uint64);
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -49,6 +54,22 @@ kvmmake(void)
   return kpgtbl;
 }
 
+// Make a kernel page table for a process: the kernel's
+// own mappings, whose top-level entries never change after
+// boot, and an upper half that ualias() fills in with the
+// process's user memory. Returns 0 if out of memory.
+pagetable_t
+kvmcreate(void)
+{
+  pagetable_t kpgtbl;
+
+  if((kpgtbl = (pagetable_t) kalloc()) == 0)
+    return 0;
+  memmove(kpgtbl, kernel_pagetable, PGSIZE/2);
+  memset(kpgtbl + 256, 0, PGSIZE/2);
+  return kpgtbl;
+}
+
 // Initialize the one kernel_pagetable
 void
 kvminit(void)
@@ -82,6 +103,9 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// If va lies in a 2-megabyte superpage, returns its level-1
+// leaf PTE, which has PTE_2M set; see pteaddr().
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
@@ -91,17 +115,28 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(*pte & PTE_2M)
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
   return &pagetable[PX(0, va)];
 }
 
+// The physical address of the page at va,
+// given the leaf PTE that walk() found for it.
+static uint64
+pteaddr(pte_t pte, uint64 va)
+{
+  if(pte & PTE_2M)
+    return PTE2PA(pte) + (PGROUNDDOWN(va) & (PGSIZE2M-1));
+  return PTE2PA(pte);
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -121,18 +156,36 @@ walkaddr(pagetable_t pagetable, uint64 va)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = pteaddr(*pte, va);
   return pa;
 }
 
-// add a mapping to the kernel page table.
+// add a mapping to the kernel page table, using
+// 2-megabyte superpages where va and pa line up.
 // only used when booting.
 // does not flush TLB or enable paging.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 n;
+
+  while(sz > 0){
+    if(va % PGSIZE2M == 0 && pa % PGSIZE2M == 0 && sz >= PGSIZE2M){
+      if(mapsuper(kpgtbl, va, pa, perm) != 0)
+        panic("kvmmap");
+      n = PGSIZE2M;
+    } else {
+      // small pages up to the next 2-megabyte boundary.
+      n = PGSIZE2M - va % PGSIZE2M;
+      if(n > sz)
+        n = sz;
+      if(mappages(kpgtbl, va, n, pa, perm) != 0)
+        panic("kvmmap");
+    }
+    va += n;
+    pa += n;
+    sz -= n;
+  }
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -164,10 +217,78 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Map the 2-megabyte superpage at va to pa, both aligned,
+// with a level-1 leaf PTE. Returns 0 on success, -1 if
+// out of memory or if something in that range of va has
+// a page-table page already.
+int
+mapsuper(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte;
+  pagetable_t pt;
+
+  if(va % PGSIZE2M != 0 || pa % PGSIZE2M != 0)
+    panic("mapsuper: not aligned");
+  pte = &pagetable[PX(2, va)];
+  if(*pte & PTE_V){
+    pt = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if((pt = (pagetable_t)kalloc_zeroed()) == 0)
+      return -1;
+    *pte = PA2PTE(pt) | PTE_V;
+  }
+  pte = &pt[PX(1, va)];
+  if(*pte & PTE_V)
+    return -1;
+  *pte = PA2PTE(pa) | perm | PTE_V | PTE_2M;
+  return 0;
+}
+
+// Replace superpage leaf *pte with a page-table page of
+// 512 small PTEs for the same memory, so that part of it
+// can be unmapped, or copied on write. Each small page
+// has its own reference count already (see uvmsuper()).
+// Returns 0 on success, -1 if out of memory.
+static int
+uvmsplit(pte_t *pte)
+{
+  pagetable_t pt;
+  uint64 pa;
+  uint flags;
+
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte) & ~PTE_2M;
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  sfence_vma();
+  return 0;
+}
+
+// If a superpage maps the page at a, and a isn't the
+// start of it, split it. Returns 0 on success, -1 if
+// out of memory.
+static int
+uvmsplitat(pagetable_t pagetable, uint64 a)
+{
+  pte_t *pte;
+
+  if(a % PGSIZE2M == 0 || a >= MAXVA)
+    return 0;
+  if((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_2M) == 0)
+    return 0;
+  return uvmsplit(pte);
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never mapped (a lazily
+// allocated heap's untouched pages) are skipped.
 // Optionally free the physical memory.
-void
+// Returns 0, or -1 with nothing unmapped if a superpage
+// that is only partly in the range can't be split.
+int
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
   uint64 a;
@@ -176,11 +297,33 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
+  // only superpages straddling the ends of the range need
+  // splitting; do that before changing anything else.
+  if(npages > 0 &&
+     (uvmsplitat(pagetable, va) != 0 ||
+      uvmsplitat(pagetable, va + npages*PGSIZE) != 0))
+    return -1;
+
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+    if((pte = walk(pagetable, a, 0)) == 0){
+      // no page-table page: skip to the next one.
+      a = PGROUNDDOWN2M(a + PGSIZE2M) - PGSIZE;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
+    if(*pte & PTE_2M){
+      if(a % PGSIZE2M == 0 && a + PGSIZE2M <= va + npages*PGSIZE){
+        // the whole superpage goes.
+        if(do_free)
+          for(int i = 0; i < 512; i++)
+            kfree((void*)(PTE2PA(*pte) + i*PGSIZE));
+        *pte = 0;
+        a += PGSIZE2M - PGSIZE;
+        continue;
+      }
+      panic("uvmunmap: part of a superpage");
+    }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -189,6 +332,10 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     }
     *pte = 0;
   }
+  // ucopy() reaches the current process's memory
+  // through the TLB, too.
+  sfence_vma();
+  return 0;
 }
 
 // create an empty user page table.
@@ -197,10 +344,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -214,8 +360,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -233,12 +378,16 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    if(a % PGSIZE2M == 0 && a + PGSIZE2M <= newsz &&
+       uvmsuper(pagetable, a, PTE_R|PTE_U|xperm) == 0){
+      a += PGSIZE2M - PGSIZE;
+      continue;
+    }
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -248,10 +397,36 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
   return newsz;
 }
 
+// Back the 2-megabyte range at va, which must be aligned,
+// with a zeroed superpage, if nothing in the range has
+// been mapped yet and a free block is at hand.
+// Returns 0 on success, or -1 if the caller should
+// use small pages instead.
+int
+uvmsuper(pagetable_t pagetable, uint64 va, int perm)
+{
+  char *mem;
+
+  if(walk(pagetable, va, 0) != 0)
+    return -1;  // there's a page-table page already
+  // each small page has its own reference count, so that
+  // the superpage can be split and its pieces kfree()d.
+  if((mem = kalloc_contig(9)) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE2M);
+  if(mapsuper(pagetable, va, (uint64)mem, perm) != 0){
+    for(int i = 0; i < 512; i++)
+      kfree(mem + i*PGSIZE);
+    return -1;
+  }
+  return 0;
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, which is
+// oldsz if a superpage needed splitting and memory ran out.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -260,7 +435,8 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-    uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+    if(uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1) != 0)
+      return oldsz;
   }
 
   return newsz;
@@ -298,40 +474,137 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies only the page table: both processes share
+// the physical pages, and writable pages become
+// read-only and copy-on-write in both (see uvmcow()).
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmcopyrange(old, new, 0, sz, 0);
+}
+
+// Copy the mappings of [start, end) from old to new,
+// as uvmcopy() does, except that if shared is set
+// writable pages stay writable in both, for MAP_SHARED
+// mappings. On failure, unmaps what it mapped.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int shared)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+  for(i = start; i < end; i += PGSIZE){
+    if((pte = walk(old, i, 0)) == 0){
+      // no page-table page: skip to the next one.
+      i = PGROUNDDOWN2M(i + PGSIZE2M) - PGSIZE;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;  // lazily allocated page not yet touched
+    if((*pte & PTE_W) && !shared)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
+    if(flags & PTE_2M){
+      // share the whole superpage.
+      if(mapsuper(new, i, pa, flags) != 0)
+        goto err;
+      for(int j = 0; j < 512; j++)
+        kpage_ref((void*)(pa + j*PGSIZE));
+      i += PGSIZE2M - PGSIZE;
+      continue;
     }
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
+      goto err;
+    kpage_ref((void*)pa);
   }
+  sfence_vma();  // old's pages may have lost PTE_W
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Handle a user page fault at va: allocate a zeroed page if
+// va is an untouched page of a heap that sbrk() grew lazily
+// (below sz), or break copy-on-write sharing if the fault was
+// a store. Returns 0 if the access can be retried, -1 if it is
+// a genuine fault.
+int
+uvmfault(pagetable_t pagetable, uint64 va, uint64 sz, int write)
+{
+  pte_t *pte;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(write && (*pte & PTE_COW))
+      return uvmcow(pagetable, va);
+    return -1;
+  }
+
+  if(va >= sz)
+    return -1;
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Give the process its own writable copy of the
+// copy-on-write page at va, after a store page fault
+// or before the kernel writes to it. If no one else
+// shares the page any more, just make it writable again.
+// Returns 0 on success, -1 if va isn't a copy-on-write
+// page or memory has run out.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  if((pte = walk(pagetable, va, 0)) == 0)
+    return -1;
+  if((*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  if(*pte & PTE_2M){
+    // copy just the page that was written.
+    if(uvmsplit(pte) != 0)
+      return -1;
+    pte = walk(pagetable, va, 0);
+  }
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(kpage_refcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    sfence_vma();
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  sfence_vma();  // for ucopy(), which uses this page table
+  return 0;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -345,17 +618,92 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Return the physical address of user page va0 for
+// copyin()/copyout(), or 0 if the user can't access it.
+// Does what a user page fault would: fills untouched
+// demand-paged or lazily-allocated pages of the current
+// process, and breaks copy-on-write sharing if the kernel
+// will write.
+static uint64
+uvmaccess(pagetable_t pagetable, uint64 va0, int write)
+{
+  struct proc *p = myproc();
+  int r;
+  pte_t *pte;
+
+  if(va0 >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va0, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_COW))){
+    if(p && p->pagetable == pagetable)
+      r = vmafault(p, va0, write);
+    else
+      r = uvmfault(pagetable, va0, 0, write);
+    if(r != 0)
+      return 0;
+    pte = walk(pagetable, va0, 0);
+  }
+  if((*pte & PTE_U) == 0 || (write && (*pte & PTE_W) == 0))
+    return 0;
+  if(write)
+    *pte |= PTE_D;  // as the MMU would; see vmaunmap()
+  return pteaddr(*pte, va0);
+}
+
+// Can the kernel reach [va, va+len) of pagetable directly,
+// at UALIAS(va)? It can if pagetable is the current process's:
+// its kernel page table's upper half holds copies of the user
+// page table's top-level entries, so the two share all the
+// lower-level page-table pages. Refreshes any of those copies
+// that are out of date.
+// Supervisor mode can use pages without PTE_U even with SUM
+// clear, so the range must stay clear of the trapframe and
+// the stack guard page.
+static int
+ualias(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  pagetable_t kpgtbl;
+  int i, stale = 0;
+
+  if(p == 0 || p->pagetable != pagetable || len == 0)
+    return 0;
+  if(va >= TRAPFRAME || len > TRAPFRAME - va)
+    return 0;
+  if(va < p->stackguard + PGSIZE && va + len > p->stackguard)
+    return 0;
+  kpgtbl = p->kpagetable;
+  if(r_satp() != MAKE_SATP(kpgtbl))
+    return 0;
+  for(i = PX(2, va); i <= PX(2, va + len - 1); i++){
+    if(kpgtbl[256 + i] != pagetable[i]){
+      kpgtbl[256 + i] = pagetable[i];
+      stale = 1;
+    }
+  }
+  if(stale)
+    sfence_vma();
+  return 1;
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
+// Copies with one ucopy() if it can; if that faults, on
+// a page that isn't there yet or is copy-on-write, say,
+// starts over a page at a time.
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(ualias(pagetable, dstva, len) &&
+     ucopy((void*)UALIAS(dstva), src, len) == 0)
+    return 0;
+
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaccess(pagetable, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -378,9 +726,13 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(ualias(pagetable, srcva, len) &&
+     ucopy(dst, (void*)UALIAS(srcva), len) == 0)
+    return 0;
+
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaccess(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -405,9 +757,18 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   uint64 n, va0, pa0;
   int got_null = 0;
 
+  if(ualias(pagetable, srcva, max)){
+    switch(ucopystr(dst, (char*)UALIAS(srcva), max)){
+    case 0:
+      return 0;
+    case 1:
+      return -1;  // no terminating 0 within max bytes
+    }
+  }
+
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaccess(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
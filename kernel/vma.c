@@ -0,0 +1,602 @@
+//
+// Regions of user memory filled in on demand.
+//
+// exec() records each loadable program segment as a struct
+// vma rather than reading it all in, and mmap() adds regions
+// backed by a file or by zeros. A page is filled the first
+// time it's touched (vmafault()). Program segments lie below
+// p->sz; mmap() places regions above it, from the trapframe
+// down, and the heap can't grow into them.
+//
+// Pages of read-only file regions (program text) are the
+// same for every process mapping the file, so they are kept
+// in a small set-associative cache keyed by (dev, inum, file
+// offset), and mapped shared. The cache holds one reference
+// on each page; processes mapping it hold the others.
+// Writing or truncating a file drops its cached pages, and
+// a file can't be written at all while a program is running
+// from it, since its pages would then come from two
+// different versions of the program.
+//
+// Modified pages of MAP_SHARED mappings go back to the file
+// when they are unmapped: by munmap(), exit() or exec().
+// Processes share them only if they inherited them by fork().
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "memlayout.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+
+#define TEXTWAYS 8      // entries per set of the text cache
+#define TEXTMAP  1024   // bits in the set of cached inums
+
+struct textpage {
+  uint dev;
+  uint inum;
+  uint off;             // page-aligned file offset
+  uint n;               // bytes from the file; the rest is zero
+  uint64 pa;            // 0 if this entry is free
+  uint lastuse;
+};
+
+struct {
+  struct spinlock lock;
+  struct textpage page[NTEXT];
+  uint64 inums[TEXTMAP/64];  // hashed set of inodes with cached pages
+  uint tick;
+  uint nhit;
+  uint nmiss;
+  uint nevict;
+  uint ninval;
+} text;
+
+void
+vmainit(void)
+{
+  initlock(&text.lock, "text");
+}
+
+static uint
+texthash(uint dev, uint inum)
+{
+  return (dev * 31 + inum) % TEXTMAP;
+}
+
+static struct textpage *
+textset(uint dev, uint inum, uint off)
+{
+  uint h = (texthash(dev, inum) * 131 + off / PGSIZE) % (NTEXT / TEXTWAYS);
+  return &text.page[h * TEXTWAYS];
+}
+
+// Look for a cached page of ip holding n bytes from off.
+// Returns its physical address with a reference added
+// for the caller, or 0.
+static uint64
+textget(struct inode *ip, uint off, uint n)
+{
+  struct textpage *t, *set;
+  uint64 pa = 0;
+
+  acquire(&text.lock);
+  set = textset(ip->dev, ip->inum, off);
+  for(t = set; t < set + TEXTWAYS; t++){
+    if(t->pa && t->dev == ip->dev && t->inum == ip->inum &&
+       t->off == off && t->n == n){
+      t->lastuse = ++text.tick;
+      pa = t->pa;
+      kpage_ref((void*)pa);
+      break;
+    }
+  }
+  if(pa)
+    text.nhit++;
+  else
+    text.nmiss++;
+  release(&text.lock);
+  return pa;
+}
+
+// Add page pa, just read from ip, to the cache,
+// evicting the least recently used page of its set.
+// Caller must hold ip->lock, so that a concurrent
+// writei() can't slip in between the read and this.
+static void
+textput(struct inode *ip, uint off, uint n, uint64 pa)
+{
+  struct textpage *t, *set, *victim;
+  uint h;
+
+  acquire(&text.lock);
+  set = textset(ip->dev, ip->inum, off);
+  victim = set;
+  for(t = set; t < set + TEXTWAYS; t++){
+    if(t->pa && t->dev == ip->dev && t->inum == ip->inum && t->off == off){
+      // another process got here first; keep ours private.
+      release(&text.lock);
+      return;
+    }
+    if(t->pa == 0 || (victim->pa && t->lastuse < victim->lastuse))
+      victim = t;
+  }
+  if(victim->pa){
+    kfree((void*)victim->pa);
+    text.nevict++;
+  }
+  victim->dev = ip->dev;
+  victim->inum = ip->inum;
+  victim->off = off;
+  victim->n = n;
+  victim->pa = pa;
+  victim->lastuse = ++text.tick;
+  kpage_ref((void*)pa);
+  h = texthash(ip->dev, ip->inum);
+  text.inums[h/64] |= 1L << (h%64);
+  release(&text.lock);
+}
+
+// ip's contents are about to change: forget its cached
+// pages. Processes that have them mapped keep their copy.
+// Caller holds ip->lock.
+void
+textinval(struct inode *ip)
+{
+  struct textpage *t;
+  uint h;
+  int busy;
+
+  // the common case, a file that was never run, costs one
+  // unlocked load; textput() sets the bit under ip->lock.
+  h = texthash(ip->dev, ip->inum);
+  if((text.inums[h/64] & (1L << (h%64))) == 0)
+    return;
+
+  acquire(&text.lock);
+  busy = 0;
+  for(t = text.page; t < &text.page[NTEXT]; t++){
+    if(t->pa == 0)
+      continue;
+    if(t->dev == ip->dev && t->inum == ip->inum){
+      kfree((void*)t->pa);
+      t->pa = 0;
+      text.ninval++;
+    } else if(texthash(t->dev, t->inum) == h)
+      busy = 1;
+  }
+  if(!busy)
+    text.inums[h/64] &= ~(1L << (h%64));
+  release(&text.lock);
+}
+
+// Drop the cache's reference on every page, for kalloc()
+// when memory runs out. Returns the number of entries
+// dropped.
+int
+textreclaim(void)
+{
+  struct textpage *t;
+  int n = 0;
+
+  acquire(&text.lock);
+  for(t = text.page; t < &text.page[NTEXT]; t++){
+    if(t->pa){
+      kfree((void*)t->pa);
+      t->pa = 0;
+      n++;
+    }
+  }
+  memset(text.inums, 0, sizeof(text.inums));
+  release(&text.lock);
+  return n;
+}
+
+int
+textstats(char *buf, int sz)
+{
+  struct textpage *t;
+  int n = 0, used = 0;
+
+  acquire(&text.lock);
+  for(t = text.page; t < &text.page[NTEXT]; t++)
+    if(t->pa)
+      used++;
+  n += snprintf(buf+n, sz-n, "--- text: pages %d hit %d miss %d evict %d inval %d\n",
+                used, text.nhit, text.nmiss, text.nevict, text.ninval);
+  release(&text.lock);
+  return n;
+}
+
+// Make v, a segment exec() is loading from ip, a text
+// mapping of ip: writei() refuses to change ip until all
+// such mappings are gone. Caller holds ip->lock, so no
+// write can be under way.
+void
+vmatext(struct vma *v, struct inode *ip)
+{
+  v->ip = idup(ip);
+  v->text = 1;
+  __sync_fetch_and_add(&ip->ntext, 1);
+}
+
+// Take another reference to v's file, for a copy of v.
+static void
+vmahold(struct vma *v)
+{
+  idup(v->ip);
+  if(v->text)
+    __sync_fetch_and_add(&v->ip->ntext, 1);
+}
+
+// Drop v's reference to its file.
+// Must be called inside a transaction.
+static void
+vmarelse(struct vma *v)
+{
+  if(v->text)
+    __sync_fetch_and_sub(&v->ip->ntext, 1);
+  iput(v->ip);
+}
+
+// Return p's region containing va, or 0.
+static struct vma *
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Map the page at va, which lies in region v, into
+// pagetable, filling it from v's file; the part of the
+// page past the end of the file, or of v's part of it,
+// is zero. Read-only pages come from, and go into, the
+// text cache.
+// Reading the file may sleep, so returns -1 rather than
+// read it if the caller holds a spinlock.
+int
+vmafill(pagetable_t pagetable, struct vma *v, uint64 va)
+{
+  uint64 pa;
+  uint off, n;
+  int r, shared, nolocks, locked;
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  off = va - v->start;
+  n = 0;
+  if(v->ip && off < v->filesz)
+    n = v->filesz - off < PGSIZE ? v->filesz - off : PGSIZE;
+  off += v->off;
+  shared = (v->perm & PTE_W) == 0 && n > 0 && off % PGSIZE == 0;
+
+  if(shared && (pa = textget(v->ip, off, n)) != 0){
+    if(mappages(pagetable, va, PGSIZE, pa, v->perm) != 0){
+      kfree((void*)pa);
+      return -1;
+    }
+    return 0;
+  }
+
+  if(n == 0){
+    // anonymous memory, or bss.
+    if((mem = kalloc_zeroed()) == 0)
+      return -1;
+  } else {
+    push_off();
+    nolocks = mycpu()->noff == 1;
+    pop_off();
+    if(!nolocks)
+      return -1;
+    if((mem = kalloc()) == 0)
+      return -1;
+    // exec() calls this with ip already locked.
+    locked = holdingsleep(&v->ip->lock);
+    if(!locked)
+      ilock(v->ip);
+    if((r = readi(v->ip, 0, (uint64)mem, off, n)) < 0)
+      r = 0;
+    else if(r == n)
+      ireadahead(v->ip, off + n, 2*PGSIZE); // programs mostly run forward
+    memset(mem + r, 0, PGSIZE - r);
+    if(shared && r == n)
+      textput(v->ip, off, n, (uint64)mem);
+    if(!locked)
+      iunlock(v->ip);
+  }
+
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, v->perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Fill in the current process's untouched pages of files
+// it has mapped in [va, va+len), so that a copy to or from
+// them won't fault. Callers do this before taking a lock
+// that filling such a page can't be done under: a spinlock,
+// or an inode or buffer lock that reading the file may need.
+// Other pages can be faulted in under any lock.
+void
+vmaprefault(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 a, end;
+  pte_t *pte;
+
+  end = va + len < va ? MAXVA : va + len;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 || v->ip == 0 || v->end <= va || v->start >= end)
+      continue;
+    a = PGROUNDDOWN(va > v->start ? va : v->start);
+    for(; a < end && a < v->end; a += PGSIZE){
+      pte = walk(p->pagetable, a, 0);
+      if((pte == 0 || (*pte & PTE_V) == 0) && vmafill(p->pagetable, v, a) != 0)
+        return;  // the copy will fail here
+    }
+  }
+}
+
+// Handle a page fault by p at va: fill an untouched
+// page of a file-backed or anonymous region, or else
+// let uvmfault() deal with copy-on-write and
+// lazily-allocated heap. An untouched 2-megabyte
+// stretch of a heap grown by big sbrk()s gets a
+// superpage; small sbrk()s, like malloc()'s, suggest
+// the memory is better spent a page at a time.
+// Returns 0 if the access can be retried.
+int
+vmafault(struct proc *p, uint64 va, int write)
+{
+  struct vma *v;
+  pte_t *pte;
+  uint64 a;
+
+  if(va >= MAXVA)
+    return -1;
+  if((v = vmalookup(p, va)) != 0){
+    pte = walk(p->pagetable, va, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0)
+      return vmafill(p->pagetable, v, va);
+  }
+
+  a = PGROUNDDOWN2M(va);
+  if(v == 0 && a >= p->bigheap && a + PGSIZE2M <= p->bigheapend &&
+     uvmsuper(p->pagetable, a, PTE_R|PTE_W|PTE_U) == 0)
+    return 0;
+  return uvmfault(p->pagetable, va, p->sz, write);
+}
+
+// Give np p's regions, for fork(). Pages below p->sz
+// have been copied by uvmcopy(); copy those of the
+// mmap()ed regions above it, sharing MAP_SHARED ones.
+int
+vmadup(struct proc *p, struct proc *np)
+{
+  int i;
+  struct vma *v;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->end == 0)
+      continue;
+    if(v->start >= p->sz &&
+       uvmcopyrange(p->pagetable, np->pagetable, v->start, v->end,
+                    v->flags & MAP_SHARED) < 0){
+      // undo. p still holds references to the inodes,
+      // so these iput()s can't need a transaction.
+      while(--i >= 0){
+        v = &np->vma[i];
+        if(v->end && v->start >= p->sz)
+          uvmunmap(np->pagetable, v->start, (v->end - v->start)/PGSIZE, 1);
+      }
+      vmafree(np->vma);
+      return -1;
+    }
+    np->vma[i] = *v;
+    if(v->ip)
+      vmahold(v);
+  }
+  return 0;
+}
+
+// Release an array of NVMA regions.
+// Must be called inside a transaction, since it
+// may drop the last reference to an inode.
+void
+vmafree(struct vma *vma)
+{
+  struct vma *v;
+
+  for(v = vma; v < &vma[NVMA]; v++){
+    if(v->ip)
+      vmarelse(v);
+    memset(v, 0, sizeof(*v));
+  }
+}
+
+// The heap may grow up to the lowest region
+// mmap() has placed above it.
+uint64
+vmalimit(struct proc *p)
+{
+  struct vma *v;
+  uint64 lim = TRAPFRAME;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && v->start >= p->sz && v->start < lim)
+      lim = v->start;
+  return lim;
+}
+
+// Map len bytes of f starting at file offset off into
+// p's address space, or len bytes of zeros if f is 0.
+// The region goes in the highest free range below the
+// trapframe. Nothing is read until the pages are touched.
+// Returns the address, or -1.
+uint64
+vmamap(struct proc *p, uint64 len, int prot, int flags, struct file *f, uint off)
+{
+  struct vma *v, *nv;
+  uint64 start, end;
+
+  if(len == 0 || len > TRAPFRAME || off % PGSIZE != 0)
+    return -1;
+  if((flags & (MAP_SHARED|MAP_PRIVATE)) == 0 ||
+     (flags & (MAP_SHARED|MAP_PRIVATE)) == (MAP_SHARED|MAP_PRIVATE))
+    return -1;
+  if((prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+    return -1;  // a PTE with no R, W or X means something else
+  if(f){
+    if(f->type != FD_INODE || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+  len = PGROUNDUP(len);
+
+  for(nv = p->vma; nv < &p->vma[NVMA] && nv->end; nv++)
+    ;
+  if(nv == &p->vma[NVMA])
+    return -1;
+
+  // first fit, from the top down.
+  end = TRAPFRAME;
+ again:
+  if(end < len || end - len < PGROUNDUP(p->sz))
+    return -1;
+  start = end - len;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end && v->start < end && v->end > start){
+      end = v->start;
+      goto again;
+    }
+  }
+
+  nv->start = start;
+  nv->end = end;
+  nv->perm = PTE_U | PTE_R;  // RISC-V has no write-only pages
+  if(prot & PROT_WRITE)
+    nv->perm |= PTE_W;
+  if(prot & PROT_EXEC)
+    nv->perm |= PTE_X;
+  nv->flags = flags & (MAP_SHARED|MAP_PRIVATE);
+  nv->ip = f ? idup(f->ip) : 0;
+  nv->text = 0;
+  nv->off = off;
+  nv->filesz = f ? len : 0;
+  return start;
+}
+
+// Write the page at va of shared mapping v, which is
+// at pa, back to v's file. Doesn't extend the file.
+static void
+vmawrite(struct vma *v, uint64 va, uint64 pa)
+{
+  // as in filewrite(): a page may take more than one
+  // system call's worth of log space.
+  int max = writeimax(log_maxop());
+  uint off = v->off + (va - v->start);
+  uint i, n;
+  int nb;
+
+  for(i = 0; i < PGSIZE; i += n){
+    n = PGSIZE - i;
+    if(n > max)
+      n = max;
+    nb = writeiblocks(n);
+    begin_opn(nb);
+    ilock(v->ip);
+    if(off + i >= v->ip->size){
+      iunlock(v->ip);
+      end_opn(nb);
+      break;
+    }
+    if(off + i + n > v->ip->size)
+      n = v->ip->size - off - i;
+    writei(v->ip, 0, pa + i, off + i, n);
+    iunlock(v->ip);
+    end_opn(nb);
+  }
+}
+
+// Unmap [addr, addr+len) from p, first writing
+// modified pages of MAP_SHARED file mappings back
+// to their files. Regions that are only partly
+// unmapped are trimmed, or split in two.
+// Returns 0, or -1 if addr isn't page-aligned, a
+// split needs a free region slot, or memory runs out.
+int
+vmaunmap(struct proc *p, uint64 addr, uint64 len)
+{
+  struct vma *v, *nv;
+  uint64 s, e, a, d;
+  pte_t *pte;
+
+  if(addr % PGSIZE != 0 || addr + len < addr)
+    return -1;
+  e = PGROUNDUP(addr + len);
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 || v->end <= addr || v->start >= e)
+      continue;
+    s = addr > v->start ? addr : v->start;
+    d = e < v->end ? e : v->end;
+
+    nv = 0;
+    if(s > v->start && d < v->end){
+      // a hole in the middle: the top part becomes
+      // a region of its own.
+      for(nv = p->vma; nv < &p->vma[NVMA] && nv->end; nv++)
+        ;
+      if(nv == &p->vma[NVMA])
+        return -1;
+    }
+
+    for(a = s; a < d; a += PGSIZE){
+      pte = walk(p->pagetable, a, 0);
+      if(pte && (*pte & PTE_V) && (*pte & PTE_D) &&
+         (v->flags & MAP_SHARED) && v->ip)
+        vmawrite(v, a, PTE2PA(*pte));
+    }
+    if(uvmunmap(p->pagetable, s, (d - s) / PGSIZE, 1) != 0)
+      return -1;
+
+    if(nv){
+      *nv = *v;
+      nv->start = d;
+      nv->off = v->off + (d - v->start);
+      nv->filesz = v->filesz > d - v->start ? v->filesz - (d - v->start) : 0;
+      if(nv->ip)
+        vmahold(nv);
+    }
+    if(s == v->start && d == v->end){
+      if(v->ip){
+        begin_op();
+        vmarelse(v);
+        end_op();
+      }
+      memset(v, 0, sizeof(*v));
+    } else if(s == v->start){
+      v->off += d - v->start;
+      v->filesz = v->filesz > d - v->start ? v->filesz - (d - v->start) : 0;
+      v->start = d;
+    } else {
+      if(v->filesz > s - v->start)
+        v->filesz = s - v->start;
+      v->end = s;
+    }
+  }
+  return 0;
+}
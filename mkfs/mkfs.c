@@ -22,7 +22,7 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = LOGSIZE;  // -l
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -77,8 +77,21 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if(argc >= 3 && strcmp(argv[1], "-l") == 0){
+    nlog = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-l nlog] fs.img files...\n");
+    exit(1);
+  }
+
+  // the kernel wants room for a few full-size system calls,
+  // after the header block.
+  if(nlog - 1 < LOGMIN){
+    fprintf(stderr, "mkfs: log of %d blocks is too small\n", nlog);
     exit(1);
   }
 
@@ -253,11 +266,11 @@ void
 iappend(uint inum, void *xp, int n)
 {
   char *p = (char*)xp;
-  uint fbn, off, n1;
+  uint fbn, off, n1, lb;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
+  int i;
 
   rinode(inum, &din);
   off = xint(din.size);
@@ -265,21 +278,26 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
+    // find fbn's run. files get consecutive blocks here,
+    // so their runs always fit in the inode.
+    x = 0;
+    for(i = 0, lb = 0; i < NEXTENT && xint(din.ext[i].len) != 0; i++){
+      if(fbn < lb + xint(din.ext[i].len)){
+        x = xint(din.ext[i].start) + fbn - lb;
+        break;
       }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      lb += xint(din.ext[i].len);
+    }
+    if(x == 0){
+      // fbn is the block after the last run.
+      if(i > 0 && xint(din.ext[i-1].start) + xint(din.ext[i-1].len) == freeblock){
+        din.ext[i-1].len = xint(xint(din.ext[i-1].len) + 1);
+      } else {
+        assert(i < NEXTENT);
+        din.ext[i].start = xint(freeblock);
+        din.ext[i].len = xint(1);
       }
-      x = xint(indirect[fbn-NDIRECT]);
+      x = freeblock++;
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
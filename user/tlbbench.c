@@ -0,0 +1,64 @@
+//
+// TLB-miss-heavy benchmark: sweep a buffer much larger than
+// the TLB's reach one page at a time, first in heap memory
+// from one big sbrk(), which the kernel backs with 2-megabyte
+// superpages, then in an anonymous mmap() region, which it
+// maps with ordinary 4096-byte pages.
+//
+// usage: tlbbench [megabytes]
+//
+
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define ROUNDS 200
+
+static int
+sweep(char *buf, int sz)
+{
+  int i, r, t0;
+
+  for(i = 0; i < sz; i += PGSIZE)
+    buf[i] = 0;  // fault everything in first
+
+  t0 = uptime();
+  for(r = 0; r < ROUNDS; r++)
+    for(i = 0; i < sz; i += PGSIZE)
+      buf[i + (r % 64) * 64]++;
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int sz, pad, t1, t2;
+  char *heap, *anon;
+
+  sz = 16;
+  if(argc > 1)
+    sz = atoi(argv[1]);
+  if(sz < 2){
+    fprintf(2, "usage: tlbbench [megabytes >= 2]\n");
+    exit(1);
+  }
+  sz = sz * 1024 * 1024;
+
+  // start the buffer on a 2-megabyte boundary so that
+  // all of it can go in superpages.
+  pad = (PGSIZE2M - (uint64)sbrk(0) % PGSIZE2M) % PGSIZE2M;
+  heap = sbrk(pad + sz);
+  anon = mmap(0, sz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(heap == (char*)-1 || anon == (char*)-1){
+    fprintf(2, "tlbbench: out of memory\n");
+    exit(1);
+  }
+  heap += pad;
+
+  t1 = sweep(heap, sz);
+  t2 = sweep(anon, sz);
+  printf("tlbbench: %d MB x %d sweeps: superpages %d ticks, 4k pages %d ticks\n",
+         sz / (1024*1024), ROUNDS, t1, t2);
+  exit(0);
+}
@@ -22,6 +22,10 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void *mmap(void*, uint, int, int, int, uint);
+int munmap(void*, uint);
+int fsync(int);
+int logcrash(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -39,3 +43,6 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+
+// statistics.c
+int statistics(void*, int);
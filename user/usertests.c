@@ -113,6 +113,40 @@ copyout(char *s)
   }
 }
 
+// system calls must not read or write pages the user can't,
+// like the stack guard page and the trapframe, even though
+// the kernel itself could.
+void
+copyguard(char *s)
+{
+  char local;
+  uint64 addrs[] = { PGROUNDDOWN((uint64)&local) - PGSIZE, TRAPFRAME };
+
+  for(int ai = 0; ai < 2; ai++){
+    uint64 addr = addrs[ai];
+    int fds[2];
+
+    if(pipe(fds) < 0){
+      printf("%s: pipe() failed\n", s);
+      exit(1);
+    }
+    if(write(fds[1], (void*)addr, 8) > 0){
+      printf("%s: write from %p succeeded\n", s, addr);
+      exit(1);
+    }
+    if(write(fds[1], "xxxxxxxx", 8) != 8){
+      printf("%s: pipe write failed\n", s);
+      exit(1);
+    }
+    if(read(fds[0], (void*)addr, 8) > 0){
+      printf("%s: read into %p succeeded\n", s, addr);
+      exit(1);
+    }
+    close(fds[0]);
+    close(fds[1]);
+  }
+}
+
 // what if you pass ridiculous string pointers to system calls?
 void
 copyinstr1(char *s)
@@ -534,6 +568,111 @@ opentest(char *s)
   }
 }
 
+// concurrent writers each fsync() after every write; fsync()
+// must wait for the group commit and then succeed.
+void
+fsynctest(char *s)
+{
+  enum { NCHILD = 3, N = 20 };
+  char name[3];
+  int i, j, fd, pid, xstatus;
+
+  if(fsync(-1) != -1 || fsync(NOFILE-1) != -1){
+    printf("%s: fsync of a bad fd succeeded\n", s);
+    exit(1);
+  }
+
+  name[0] = 'y';
+  name[2] = 0;
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      name[1] = '0' + i;
+      fd = open(name, O_CREATE | O_RDWR);
+      if(fd < 0){
+        printf("%s: create failed\n", s);
+        exit(1);
+      }
+      for(j = 0; j < N; j++){
+        if(write(fd, name, 2) != 2 || fsync(fd) != 0){
+          printf("%s: write or fsync failed\n", s);
+          exit(1);
+        }
+      }
+      close(fd);
+      exit(0);
+    }
+  }
+
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+
+  for(i = 0; i < NCHILD; i++){
+    name[1] = '0' + i;
+    fd = open(name, O_RDONLY);
+    if(fd < 0 || read(fd, buf, sizeof(buf)) != 2*N){
+      printf("%s: %s has the wrong size\n", s, name);
+      exit(1);
+    }
+    close(fd);
+    unlink(name);
+  }
+}
+
+// have the kernel tear commits part way through writing them
+// to the log, and check that recovery would replay only the
+// transactions that made it to the log whole.
+void
+logtorn(char *s)
+{
+  enum { NB = 3 };
+  // crash before anything is written, after the descriptor,
+  // after a data block, and after the whole transaction.
+  int tears[] = { 0, 1, 2, 1000 };
+  int fd, i, j, r, tries;
+
+  fd = open("torn", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create torn failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(tears)/sizeof(tears[0]); i++){
+    for(tries = 0; ; tries++){
+      // blocks that can't already be sitting in the log.
+      for(j = 0; j < NB; j++){
+        memset(buf + j*BSIZE, 'a' + j, BSIZE);
+        ((int*)(buf + j*BSIZE))[0] = uptime();
+        ((int*)(buf + j*BSIZE))[1] = i*100 + tries;
+      }
+      if(write(fd, buf, NB*BSIZE) != NB*BSIZE){
+        printf("%s: write failed\n", s);
+        exit(1);
+      }
+      // 1: the transaction was committed before logcrash().
+      if((r = logcrash(tears[i])) != 1)
+        break;
+      if(tries > 10){
+        printf("%s: no open transaction to tear\n", s);
+        exit(1);
+      }
+    }
+    if(r != 0){
+      printf("%s: recovery mishandles a commit torn after %d blocks\n",
+             s, tears[i]);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("torn");
+}
+
 void
 writetest(char *s)
 {
@@ -575,9 +714,12 @@ writetest(char *s)
   }
 }
 
+// a file of a few megabytes, more than an i-node
+// used to be able to map without extents.
 void
 writebig(char *s)
 {
+  enum { N = 4096 };
   int i, fd, n;
 
   fd = open("big", O_CREATE|O_RDWR);
@@ -586,7 +728,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < N; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -606,7 +748,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != N){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -730,6 +872,88 @@ exectest(char *s)
 
 }
 
+// run prog from the file "xprog" with input in, and
+// check that it prints out.
+static void
+xprogrun(char *s, char **argv, char *in, char *out)
+{
+  int fds[2], fdo[2], pid, xstatus, n, m;
+  char buf[32];
+
+  if(pipe(fds) < 0 || pipe(fdo) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(0);
+    dup(fds[0]);
+    close(1);
+    dup(fdo[1]);
+    close(fds[0]);
+    close(fds[1]);
+    close(fdo[0]);
+    close(fdo[1]);
+    exec("xprog", argv);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fdo[1]);
+  write(fds[1], in, strlen(in));
+  close(fds[1]);
+  n = 0;
+  while(n < sizeof(buf) && (m = read(fdo[0], buf+n, sizeof(buf)-n)) > 0)
+    n += m;
+  close(fdo[0]);
+  wait(&xstatus);
+  if(xstatus != 0 || n != strlen(out) || memcmp(buf, out, n) != 0){
+    printf("%s: %s: wrong output\n", s, argv[0]);
+    exit(1);
+  }
+}
+
+// copy the program file from to "xprog".
+static void
+xprogcopy(char *s, char *from)
+{
+  int fd, fdw, n;
+
+  fd = open(from, O_RDONLY);
+  fdw = open("xprog", O_CREATE|O_TRUNC|O_WRONLY);
+  if(fd < 0 || fdw < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  while((n = read(fd, buf, sizeof(buf))) > 0){
+    if(write(fdw, buf, n) != n){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  close(fdw);
+}
+
+// exec shares program text between runs of the same
+// file; rewriting the file must not run the old text.
+void
+execrewrite(char *s)
+{
+  char *echoargv[] = { "echo", "OK", 0 };
+  char *catargv[] = { "cat", 0 };
+
+  xprogcopy(s, "echo");
+  xprogrun(s, echoargv, "", "OK\n");
+  xprogrun(s, echoargv, "", "OK\n");
+  xprogcopy(s, "cat");
+  xprogrun(s, catargv, "hi", "hi");
+  unlink("xprog");
+}
+
 // simple fork and pipe read/write
 
 void
@@ -1212,6 +1436,75 @@ fourfiles(char *s)
   }
 }
 
+// four processes repeatedly read back different files at
+// the same time, together touching more blocks than the buffer
+// cache holds, so that lookups and recycling race across harts.
+void
+bcacherace(char *s)
+{
+  enum { NCHILD = 4, NBLK = 12, ROUNDS = 10 };
+  char name[3];
+  int pid, i, b, r, fd, xstatus;
+
+  name[0] = 'b';
+  name[2] = 0;
+  for(i = 0; i < NCHILD; i++){
+    name[1] = '0' + i;
+    unlink(name);
+    fd = open(name, O_CREATE | O_RDWR);
+    if(fd < 0){
+      printf("%s: create failed\n", s);
+      exit(1);
+    }
+    for(b = 0; b < NBLK; b++){
+      memset(buf, 'a' + i + b, BSIZE);
+      if(write(fd, buf, BSIZE) != BSIZE){
+        printf("%s: write failed\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      name[1] = '0' + i;
+      for(r = 0; r < ROUNDS; r++){
+        fd = open(name, O_RDONLY);
+        if(fd < 0){
+          printf("%s: open failed\n", s);
+          exit(1);
+        }
+        for(b = 0; b < NBLK; b++){
+          if(read(fd, buf, BSIZE) != BSIZE ||
+             buf[0] != 'a' + i + b || buf[BSIZE-1] != 'a' + i + b){
+            printf("%s: wrong data in block %d\n", s, b);
+            exit(1);
+          }
+        }
+        close(fd);
+      }
+      exit(0);
+    }
+  }
+
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+
+  for(i = 0; i < NCHILD; i++){
+    name[1] = '0' + i;
+    unlink(name);
+  }
+}
+
 // four processes create and delete different files in same directory
 void
 createdelete(char *s)
@@ -1993,6 +2286,53 @@ forktest(char *s)
   }
 }
 
+// fork a process that uses two thirds of physical memory,
+// which only fits if fork() shares pages copy-on-write,
+// and check that the child's writes stay private.
+void
+cowfork(char *s)
+{
+  uint64 sz = ((PHYSTOP - KERNBASE) / 3) * 2;
+  char *p, *q;
+  int pid, ppid, xstatus;
+
+  ppid = getpid();
+  p = sbrk(sz);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, sz);
+    exit(1);
+  }
+  for(q = p; q < p + sz; q += 4096)
+    *(int*)q = ppid;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(q = p; q < p + sz; q += 64*4096){
+      if(*(int*)q != ppid){
+        printf("%s: child sees wrong value\n", s);
+        exit(1);
+      }
+      *(int*)q = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+
+  for(q = p; q < p + sz; q += 4096){
+    if(*(int*)q != ppid){
+      printf("%s: child's write showed up in parent\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-sz);
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2234,7 +2574,176 @@ sbrkfail(char *s)
     exit(1);
 }
 
-  
+
+// grow the heap by far more than physical memory, which only
+// works if sbrk() allocates lazily, then touch a few pages
+// directly and through system calls.
+void
+sbrklazy(char *s)
+{
+  enum { HUGE=1024*1024*1024 };
+  char *a, *b;
+  int fd;
+
+  a = sbrk(HUGE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(HUGE) failed\n", s);
+    exit(1);
+  }
+  a[0] = 1;
+  a[HUGE/2] = 2;
+  a[HUGE-1] = 3;
+  if(a[0] != 1 || a[HUGE/2] != 2 || a[HUGE-1] != 3 || a[HUGE/4] != 0){
+    printf("%s: wrong contents\n", s);
+    exit(1);
+  }
+
+  // the kernel must fault in untouched pages for copyout().
+  b = a + HUGE/4 + 100;
+  fd = open("README", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open README failed\n", s);
+    exit(1);
+  }
+  if(read(fd, b, 10) != 10){
+    printf("%s: read into lazy page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(sbrk(-HUGE) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(-HUGE) failed\n", s);
+    exit(1);
+  }
+}
+
+// map a file both shared and private, and check that only
+// changes to the shared mapping reach the file, including
+// those made by a child that inherited it.
+void
+mmaptest(char *s)
+{
+  int fd, i, pid, xstatus, fds[2];
+  int n = 2*PGSIZE + PGSIZE/2;
+  char *p, *q, *a;
+  struct stat st;
+
+  for(i = 0; i < n; i++)
+    buf[i] = 'a' + i % 26;
+  fd = open("mmapfile", O_CREATE|O_TRUNC|O_RDWR);
+  if(fd < 0 || write(fd, buf, n) != n){
+    printf("%s: create mmapfile failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  q = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1 || q == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3*PGSIZE; i++){
+    if(p[i] != (i < n ? buf[i] : 0) || q[i] != p[i]){
+      printf("%s: wrong mapped byte at %d\n", s, i);
+      exit(1);
+    }
+  }
+
+  q[0] = 'Q';
+  p[1] = 'P';
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    p[2] = 'C';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[2] != 'C' || q[2] == 'C'){
+    printf("%s: child's store not shared\n", s);
+    exit(1);
+  }
+  if(munmap(p, 3*PGSIZE) < 0 || munmap(q, 3*PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(fd < 0 || read(fd, buf, 3) != 3 || fstat(fd, &st) < 0){
+    printf("%s: reopen failed\n", s);
+    exit(1);
+  }
+  if(buf[0] != 'a' || buf[1] != 'P' || buf[2] != 'C' || st.size != n){
+    printf("%s: file not written back\n", s);
+    exit(1);
+  }
+  if(mmap(0, PGSIZE, PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1){
+    printf("%s: writable mapping of read-only file\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // read() into and write() from untouched pages of the
+  // file's own mapping, and read a pipe into one.
+  fd = open("mmapfile", O_RDWR);
+  if(fd < 0 || (p = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == (char*)-1){
+    printf("%s: mmap of mmapfile failed\n", s);
+    exit(1);
+  }
+  if(read(fd, p, PGSIZE) != PGSIZE || p[1] != 'P' ||
+     write(fd, p + PGSIZE, PGSIZE) != PGSIZE){
+    printf("%s: read/write through own mapping failed\n", s);
+    exit(1);
+  }
+  if(pipe(fds) < 0 || write(fds[1], "x", 1) != 1 ||
+     read(fds[0], p + 2*PGSIZE, 1) != 1 || p[2*PGSIZE] != 'x'){
+    printf("%s: pipe read into mapping failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  // wait() into an untouched private mapping.
+  q = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(q == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(7);
+  if(wait((int*)q) != pid || *(int*)q != 7 || munmap(q, PGSIZE) < 0){
+    printf("%s: wait into mapping failed\n", s);
+    exit(1);
+  }
+
+  if(munmap(p, 3*PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+
+  // anonymous memory, unmapped a page at a time.
+  a = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(a == (char*)-1 || a[0] != 0 || a[PGSIZE] != 0){
+    printf("%s: anonymous mmap failed\n", s);
+    exit(1);
+  }
+  a[PGSIZE] = 1;
+  if(munmap(a, PGSIZE) < 0 || a[PGSIZE] != 1 || munmap(a + PGSIZE, PGSIZE) < 0){
+    printf("%s: partial munmap failed\n", s);
+    exit(1);
+  }
+}
+
 // test reads/writes from/to allocated memory
 void
 sbrkarg(char *s)
@@ -2395,6 +2904,24 @@ void argptest(char *s)
   close(fd);
 }
 
+// a running program's file can't be written.
+void
+textbusy(char *s)
+{
+  int fd;
+
+  if(open("usertests", O_RDWR) >= 0 || open("usertests", O_WRONLY|O_TRUNC) >= 0){
+    printf("%s: opened running program for writing\n", s);
+    exit(1);
+  }
+  fd = open("usertests", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open usertests failed\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
 // check that there's an invalid page beneath
 // the user stack, to catch stack overflow.
 void
@@ -2577,6 +3104,7 @@ struct test {
 } quicktests[] = {
   {copyin, "copyin"},
   {copyout, "copyout"},
+  {copyguard, "copyguard"},
   {copyinstr1, "copyinstr1"},
   {copyinstr2, "copyinstr2"},
   {copyinstr3, "copyinstr3"},
@@ -2589,10 +3117,13 @@ struct test {
   {iputtest, "iput"},
   {opentest, "opentest"},
   {writetest, "writetest"},
+  {fsynctest, "fsynctest"},
+  {logtorn, "logtorn"},
   {writebig, "writebig"},
   {createtest, "createtest"},
   {dirtest, "dirtest"},
   {exectest, "exectest"},
+  {execrewrite, "execrewrite"},
   {pipe1, "pipe1"},
   {killstatus, "killstatus"},
   {preempt, "preempt"},
@@ -2605,6 +3136,7 @@ struct test {
   {mem, "mem"},
   {sharedfd, "sharedfd"},
   {fourfiles, "fourfiles"},
+  {bcacherace, "bcacherace"},
   {createdelete, "createdelete"},
   {unlinkread, "unlinkread"},
   {linktest, "linktest"},
@@ -2618,12 +3150,16 @@ struct test {
   {dirfile, "dirfile"},
   {iref, "iref"},
   {forktest, "forktest"},
+  {cowfork, "cowfork"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
   {kernmem, "kernmem"},
   {MAXVAplus, "MAXVAplus"},
   {sbrkfail, "sbrkfail"},
   {sbrkarg, "sbrkarg"},
+  {sbrklazy, "sbrklazy"},
+  {mmaptest, "mmaptest"},
+  {textbusy, "textbusy"},
   {validatetest, "validatetest"},
   {bsstest, "bsstest"},
   {bigargtest, "bigargtest"},